@@ -0,0 +1,129 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+#include "header_compressor.hpp"
+
+
+/**
+ * Drops pure TCP ACKs of a batch that a later ACK of the same flow in the
+ * batch makes redundant, since ACKs are cumulative. An ACK is pure if it
+ * has no data, no flags other than ACK and no options other than
+ * timestamps, so SACK blocks, window probes and handshakes pass untouched.
+ * Duplicate ACKs are kept, the sender counts them to detect loss.
+ *
+ * Not thread-safe, keeps its buffers between batches.
+ */
+class AckFilter {
+    using H = HeaderCompression;
+
+    static constexpr uint8_t TCP_FLAG_ACK = 0x10;
+
+public:
+    struct Ack {
+        /** Source and destination addresses and ports */
+        std::array<uint8_t, 12> flow;
+        uint32_t sequence;
+        uint32_t ack;
+    };
+
+private:
+    /** Newest ACK of each flow seen so far, scanning the batch backwards */
+    std::vector<Ack> _newest;
+    std::vector<bool> _redundant;
+
+public:
+    /**
+     * Parse a pure ACK
+     * @return false if packet is not one
+     */
+    static bool parse(std::string_view packet, Ack & ack) {
+        H::Headers headers;
+        if (!H::parse(packet, headers) || headers.protocol != H::PROTOCOL_TCP || headers.header_size != packet.size()) {
+            return false;
+        }
+        auto p = headers.data;
+        if (p[33] != TCP_FLAG_ACK) {
+            return false;
+        }
+        for (size_t i = H::IP_HEADER_SIZE + 20; i < headers.header_size; ) {
+            if (p[i] == 0) {
+                break;
+            }
+            if (p[i] == 1) {
+                i++;
+                continue;
+            }
+            // Only timestamps, H::parse() checked the lengths
+            if (p[i] != 8) {
+                return false;
+            }
+            i += p[i + 1];
+        }
+        std::memcpy(ack.flow.data(), p + 12, 8);
+        std::memcpy(ack.flow.data() + 8, p + H::IP_HEADER_SIZE, 4);
+        ack.sequence = H::get32(p + H::IP_HEADER_SIZE + 4);
+        ack.ack = H::get32(p + H::IP_HEADER_SIZE + 8);
+        return true;
+    }
+
+    /**
+     * Remove redundant ACKs from packets, keeping the order of the rest.
+     * Packet is a type with data, a buffer with data() and size().
+     * @param on_drop - called with every removed packet
+     * @return number of removed packets
+     */
+    template <typename Packet, typename OnDrop>
+    size_t thin(std::vector<Packet> & packets, OnDrop && on_drop) {
+        _newest.clear();
+        _redundant.assign(packets.size(), false);
+        size_t dropped = 0;
+        for (size_t i = packets.size(); i-- > 0; ) {
+            Ack ack;
+            if (!parse(std::string_view(packets[i].data.data(), packets[i].data.size()), ack)) {
+                continue;
+            }
+            auto newest = _find(ack);
+            if (!newest) {
+                _newest.push_back(ack);
+                continue;
+            }
+            // Sequence and ACK numbers wrap around
+            if ((int32_t) (newest->ack - ack.ack) > 0 && (int32_t) (newest->sequence - ack.sequence) >= 0) {
+                _redundant[i] = true;
+                dropped++;
+            }
+        }
+        if (!dropped) {
+            return 0;
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < packets.size(); i++) {
+            if (_redundant[i]) {
+                on_drop(packets[i]);
+                continue;
+            }
+            if (kept != i) {
+                packets[kept] = std::move(packets[i]);
+            }
+            kept++;
+        }
+        packets.resize(kept);
+        return dropped;
+    }
+
+private:
+    const Ack * _find(const Ack & ack) const {
+        for (const auto & newest : _newest) {
+            if (newest.flow == ack.flow) {
+                return &newest;
+            }
+        }
+        return nullptr;
+    }
+};
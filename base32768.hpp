@@ -0,0 +1,245 @@
+#pragma once
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#if CHAR_BIT != 8
+#error DESIGNED ONLY FOR 8 BIT BYTE (CHAR)
+#endif
+
+//------------------------------------------------------------------------------
+/**
+ * Class base32768 packs 15 bits into one character of the Basic Multilingual
+ * Plane, similar in spirit to base32768 by qntm.
+ * Telegram limits messages by UTF-16 code units, so one character costs the
+ * same as a base91x symbol but carries 15 bits instead of 6.5.
+ *
+ * The alphabet consists of characters that are stable under Unicode
+ * normalization, are not whitespace, control or combining characters and
+ * are rendered as single glyphs:
+ *   U+4E00..U+9FFF CJK Unified Ideographs (20992)
+ *   U+3400..U+4DBF CJK Unified Ideographs Extension A (6592)
+ *   U+AC00..U+C03F Hangul Syllables (5184)
+ * The final 1..7 bits are coded with one of 128 Yi Syllables U+A000..U+A07F.
+ *
+ * Encoded text is UTF-8, 3 bytes per character.
+ * Characters out of the alphabet are skipped on decoding.
+ */
+class base32768
+{
+public:
+    /** Bits coded by one character */
+    static const unsigned word_bit = 15;
+
+    /** Bits coded by the final short character */
+    static const unsigned tail_bit = 7;
+
+    /** UTF-8 bytes per character */
+    static const unsigned char_size = 3;
+
+    /**
+     * Calculate number of characters (UTF-16 code units) in encoded data
+     * @param size - size of data to encoding
+     * @return length of encoded text in characters
+     */
+    static inline size_t compute_encoded_length(size_t size)
+    {
+        return (size * CHAR_BIT + word_bit - 1) / word_bit;
+    }
+
+    /**
+     * Calculate exactly size in bytes required for encoded data
+     * @param size - size of data to encoding
+     * @return size of encoded data
+     */
+    static inline size_t compute_encoded_size(size_t size)
+    {
+        return compute_encoded_length(size) * char_size;
+    }
+
+    /**
+     * Assume maximal size for decoded data
+     * @param size - size of data to decoding
+     * @return maximal size of decoded data
+     */
+    static inline size_t assume_decoded_size(size_t size)
+    {
+        return size / char_size * word_bit / CHAR_BIT;
+    }
+
+    /**
+     * Encode raw buffer
+     * @param data[IN] - data to encode
+     * @param size - size of data
+     * @param text[OUT] - buffer of at least compute_encoded_size(size) bytes
+     * @return number of bytes written
+     */
+    static size_t encode(const void *data, size_t size, char *text)
+    {
+        const auto *in = static_cast<const unsigned char *>(data);
+        char *const begin = text;
+        std::uint32_t collector = 0;
+        unsigned bit_collected = 0;
+
+        for (const unsigned char *end = in + size; in != end; ++in)
+        {
+            collector = collector << CHAR_BIT | *in;
+            bit_collected += CHAR_BIT;
+            if (word_bit <= bit_collected)
+            {
+                bit_collected -= word_bit;
+                text = put(text, word_to_code_point((collector >> bit_collected) & word_mask));
+            }
+        }
+
+        if (0 != bit_collected && bit_collected <= tail_bit)
+        {
+            // Pad with ones so that the padding never looks like a zero byte
+            const unsigned padding = tail_bit - bit_collected;
+            const std::uint32_t value = ((collector << padding) | ((1u << padding) - 1)) & tail_mask;
+            text = put(text, tail_begin + value);
+        }
+        else if (0 != bit_collected)
+        {
+            const unsigned padding = word_bit - bit_collected;
+            const std::uint32_t value = ((collector << padding) | ((1u << padding) - 1)) & word_mask;
+            text = put(text, word_to_code_point(value));
+        }
+        return text - begin;
+    }
+
+    /**
+     * Decode raw buffer
+     * @param text[IN] - UTF-8 text to decode
+     * @param size - size of text in bytes
+     * @param data[OUT] - buffer of at least assume_decoded_size(size) bytes
+     * @return number of bytes written
+     */
+    static size_t decode(const char *text, size_t size, void *data)
+    {
+        auto *out = static_cast<unsigned char *>(data);
+        unsigned char *const begin = out;
+        std::uint32_t collector = 0;
+        unsigned bit_collected = 0;
+
+        const auto *in = reinterpret_cast<const unsigned char *>(text);
+        const auto *end = in + size;
+        while (in != end)
+        {
+            // Only 3-byte UTF-8 sequences can belong to the alphabet
+            if ((in[0] & 0xF0) != 0xE0 || end - in < 3 || (in[1] & 0xC0) != 0x80 || (in[2] & 0xC0) != 0x80)
+            {
+                ++in;
+                continue;
+            }
+            const std::uint32_t code_point = (in[0] & 0x0Fu) << 12 | (in[1] & 0x3Fu) << 6 | (in[2] & 0x3Fu);
+            in += char_size;
+
+            std::uint32_t value;
+            unsigned bits;
+            if (code_point_to_word(code_point, value))
+            {
+                bits = word_bit;
+            }
+            else if (tail_begin <= code_point && code_point < tail_begin + (1u << tail_bit))
+            {
+                value = code_point - tail_begin;
+                bits = tail_bit;
+            }
+            else
+            {
+                continue;
+            }
+
+            collector = collector << bits | value;
+            bit_collected += bits;
+            while (CHAR_BIT <= bit_collected)
+            {
+                bit_collected -= CHAR_BIT;
+                *out++ = static_cast<unsigned char>(collector >> bit_collected);
+            }
+            collector &= (1u << bit_collected) - 1;
+        }
+        return out - begin;
+    }
+
+    /**
+     * Encode 8bit based container(vector) to string
+     * @param data[IN] - 8bit based std::vector
+     * @param text[OUT] - std::string
+     */
+    template <typename Container>
+    static void encode(const Container &data, std::string &text,
+        typename std::enable_if<sizeof(typename Container::value_type) == sizeof(char)>::type * = nullptr)
+    {
+        text.resize(compute_encoded_size(data.size()));
+        text.resize(encode(data.data(), data.size(), text.data()));
+    }
+
+    /**
+     * Decode string to binary std::vector
+     * @param text[IN] - std::string
+     * @param data[OUT] - std::vector of 8bit elements
+     */
+    template <typename StringType, typename Container>
+    static void decode(const StringType &text, Container &data,
+                       typename std::enable_if<
+                           std::is_convertible_v<StringType, std::string_view> &&
+                           sizeof(typename Container::value_type) == sizeof(char)
+                       >::type * = nullptr)
+    {
+        const std::string_view view(text);
+        data.resize(assume_decoded_size(view.size()));
+        data.resize(decode(view.data(), view.size(), data.data()));
+    }
+
+private:
+    static const std::uint32_t word_mask = (1u << word_bit) - 1;
+    static const std::uint32_t tail_mask = (1u << tail_bit) - 1;
+
+    static const std::uint32_t cjk_begin = 0x4E00;
+    static const std::uint32_t cjk_size = 0x9FFF - 0x4E00 + 1;
+    static const std::uint32_t cjk_a_begin = 0x3400;
+    static const std::uint32_t cjk_a_size = 0x4DBF - 0x3400 + 1;
+    static const std::uint32_t hangul_begin = 0xAC00;
+    static const std::uint32_t hangul_size = (1u << word_bit) - cjk_size - cjk_a_size;
+    static const std::uint32_t tail_begin = 0xA000;
+
+    static inline std::uint32_t word_to_code_point(std::uint32_t word)
+    {
+        if (word < cjk_size)
+            return cjk_begin + word;
+        word -= cjk_size;
+        if (word < cjk_a_size)
+            return cjk_a_begin + word;
+        return hangul_begin + word - cjk_a_size;
+    }
+
+    static inline bool code_point_to_word(std::uint32_t code_point, std::uint32_t &word)
+    {
+        if (cjk_begin <= code_point && code_point < cjk_begin + cjk_size)
+            word = code_point - cjk_begin;
+        else if (cjk_a_begin <= code_point && code_point < cjk_a_begin + cjk_a_size)
+            word = cjk_size + code_point - cjk_a_begin;
+        else if (hangul_begin <= code_point && code_point < hangul_begin + hangul_size)
+            word = cjk_size + cjk_a_size + code_point - hangul_begin;
+        else
+            return false;
+        return true;
+    }
+
+    /** Write BMP code point as 3-byte UTF-8 */
+    static inline char *put(char *text, std::uint32_t code_point)
+    {
+        *text++ = static_cast<char>(0xE0 | code_point >> 12);
+        *text++ = static_cast<char>(0x80 | (code_point >> 6 & 0x3F));
+        *text++ = static_cast<char>(0x80 | (code_point & 0x3F));
+        return text;
+    }
+};
+
+//------------------------------------------------------------------------------
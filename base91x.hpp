@@ -28,8 +28,15 @@ SOFTWARE.
 #include <string>
 #include <string_view>
 #include <climits>
+#include <cstring>
+#include <type_traits>
 //#include <cstdlib>
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BASE91X_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 #if CHAR_BIT != 8
 #error DESIGNED ONLY FOR 8 BIT BYTE (CHAR)
 #endif
@@ -47,6 +54,11 @@ SOFTWARE.
  * to escate / Slash.
  * Encoded string size ~ 1.231 * original size.
  * There is possibility to extend the algorithm to use 89 codes during decode.
+ *
+ * Every 13 bytes of data make exactly 8 words of 13 bits, i.e. 16 symbols,
+ * so whole 13-byte blocks are coded with SSSE3 or AVX2 kernels selected at
+ * runtime and the tail is coded with the scalar kernel. Output is identical
+ * for all kernels.
  */
 
 class base91x
@@ -116,11 +128,45 @@ public:
      */
     static inline size_t assume_decoded_size(size_t size)
     {
+        // Odd trailing symbol carries 7 bits, hence + 1
         size *= b91word_bit;
+        size += 1;
         size >>= 4;
         return size;
     }
 
+    /**
+     * Encode raw buffer
+     * @param data[IN] - data to encode
+     * @param size - size of data
+     * @param text[OUT] - buffer of at least compute_encoded_size(size) symbols
+     * @return number of symbols written
+     */
+    static size_t encode(const void *data, size_t size, char *text)
+    {
+        static const auto kernel = select_encode_kernel();
+        const auto *in = static_cast<const unsigned char *>(data);
+        const size_t consumed = kernel(in, size, text);
+        const size_t written = consumed / block_size * block_symbols;
+        return written + encode_scalar(in + consumed, size - consumed, text + written);
+    }
+
+    /**
+     * Decode raw buffer, symbols out of alphabet are skipped
+     * @param text[IN] - symbols to decode
+     * @param size - number of symbols
+     * @param data[OUT] - buffer of at least assume_decoded_size(size) bytes
+     * @return number of bytes written
+     */
+    static size_t decode(const char *text, size_t size, void *data)
+    {
+        static const auto kernel = select_decode_kernel();
+        auto *out = static_cast<unsigned char *>(data);
+        const size_t consumed = kernel(text, size, out);
+        const size_t written = consumed / block_symbols * block_size;
+        return written + decode_scalar(text + consumed, size - consumed, out + written);
+    }
+
     /**
      * Encode 8bit based container(vector) to string
      * @param data[IN] - 8bit based std::vector
@@ -129,23 +175,66 @@ public:
      */
     template <typename Container>
     static void encode(const Container &data, std::string &text,
-        typename std::enable_if<sizeof(typename Container::value_type) == sizeof(char)>::type *dummy = nullptr)
+        typename std::enable_if<sizeof(typename Container::value_type) == sizeof(char)>::type * = nullptr)
     {
-        text.clear();
-        text.reserve(compute_encoded_size(data.size()));
+        text.resize(compute_encoded_size(data.size()));
+        text.resize(encode(data.data(), data.size(), text.data()));
+    }
 
+    /**
+     * Decode string to binary std::vector
+     * @param text[IN] - std::string
+     * @param data[OUT] - std::vector of 8bit elements
+     * @param dummy - do not use
+     */
+    template <typename StringType, typename Container>
+    static void decode(const StringType &text, Container &data,
+                       typename std::enable_if<
+                           std::is_convertible_v<StringType, std::string_view> &&
+                           sizeof(typename Container::value_type) == sizeof(char)
+                       >::type * = nullptr)
+    {
+        const std::string_view view(text);
+        data.resize(assume_decoded_size(view.size()));
+        data.resize(decode(view.data(), view.size(), data.data()));
+    }
+
+private:
+    /** 13 bytes of data make 8 base91x words */
+    static const size_t block_size = 13;
+
+    /** 8 base91x words make 16 symbols */
+    static const size_t block_symbols = 16;
+
+    /** Kernel coding whole blocks, returns number of input elements consumed */
+    using encode_kernel = size_t (*)(const unsigned char *, size_t, char *);
+    using decode_kernel = size_t (*)(const char *, size_t, unsigned char *);
+
+    static size_t encode_blocks_none(const unsigned char *, size_t, char *)
+    {
+        return 0;
+    }
+
+    static size_t decode_blocks_none(const char *, size_t, unsigned char *)
+    {
+        return 0;
+    }
+
+    static size_t encode_scalar(const unsigned char *data, size_t size, char *text)
+    {
+        char *const begin = text;
         unsigned collector = 0;
         unsigned bit_collected = 0;
 
-        for (const auto &i : data)
+        for (const unsigned char *end = data + size; data != end; ++data)
         {
-            collector |= static_cast<unsigned char>(i) << bit_collected;
+            collector |= static_cast<unsigned>(*data) << bit_collected;
             bit_collected += char_bit;
             while (b91word_bit <= bit_collected)
             {
-                div_t d = std::div(b91word_mask & collector, BASE91X_LEN);
-                text.push_back(BASE91X_ALPHABET[d.rem]);
-                text.push_back(BASE91X_ALPHABET[d.quot]);
+                const unsigned word = b91word_mask & collector;
+                *text++ = BASE91X_ALPHABET[word % BASE91X_LEN];
+                *text++ = BASE91X_ALPHABET[word / BASE91X_LEN];
                 collector >>= b91word_bit;
                 bit_collected -= b91word_bit;
             }
@@ -153,42 +242,31 @@ public:
 
         if (0 != bit_collected)
         {
-            const div_t d = std::div(b91word_mask & collector, BASE91X_LEN);
-            text.push_back(BASE91X_ALPHABET[d.rem]);
+            const unsigned word = b91word_mask & collector;
+            *text++ = BASE91X_ALPHABET[word % BASE91X_LEN];
             if (7 <= bit_collected)
             {
-                text.push_back(BASE91X_ALPHABET[d.quot]);
+                *text++ = BASE91X_ALPHABET[word / BASE91X_LEN];
             }
         }
+        return text - begin;
     }
 
-    /**
-     * Decode string to binary std::vector
-     * @param text[IN] - std::string
-     * @param data[OUT] - std::vector of 8bit elements
-     * @param dummy - do not use
-     */
-    template <typename StringType, typename Container>
-    static void decode(const StringType &text, Container &data,
-                       typename std::enable_if<
-                           std::is_convertible_v<StringType, std::string_view> &&
-                           sizeof(typename Container::value_type) == sizeof(char)
-                       >::type* dummy = nullptr)
+    static size_t decode_scalar(const char *text, size_t size, unsigned char *data)
     {
-        data.clear();
-        data.reserve(assume_decoded_size(text.size()));
-
+        unsigned char *const begin = data;
         unsigned collector = 0;
         unsigned bit_collected = 0;
-        char lower = -1;
+        int lower = -1;
 
-        for (const auto &i : text)
+        for (const char *end = text + size; text != end; ++text)
         {
-            if (zyx_mask < static_cast<unsigned char>(i))
+            const auto symbol = static_cast<unsigned char>(*text);
+            if (zyx_mask < symbol)
             {
                 continue;
             }
-            const char digit = BASE91X_ZYX[zyx_mask & i];
+            const int digit = BASE91X_ZYX[symbol];
             if (-1 == digit)
             {
                 continue;
@@ -199,13 +277,13 @@ public:
                 continue;
             }
 
-            collector |= (BASE91X_LEN * digit + lower) << bit_collected;
+            collector |= static_cast<unsigned>(BASE91X_LEN * digit + lower) << bit_collected;
             bit_collected += b91word_bit;
             lower = -1;
 
             while (char_bit <= bit_collected)
             {
-                data.push_back(static_cast<unsigned char>(0xFF & collector));
+                *data++ = static_cast<unsigned char>(0xFF & collector);
                 collector >>= char_bit;
                 bit_collected -= char_bit;
             }
@@ -213,12 +291,214 @@ public:
 
         if (-1 != lower)
         {
-            collector |= lower << bit_collected;
+            collector |= static_cast<unsigned>(lower) << bit_collected;
             bit_collected += (char_bit - 1);
         }
 
         if (char_bit <= bit_collected)
-            data.push_back(static_cast<unsigned char>(0xFF & collector));
+            *data++ = static_cast<unsigned char>(0xFF & collector);
+        return data - begin;
+    }
+
+#if BASE91X_X86_SIMD
+    /*
+     * Word k of a block starts at bit 13k, i.e. at byte b = 13k / 8 with shift s = 13k % 8:
+     *   word = (byte[b] >> s | (byte[b + 1] | byte[b + 2] << 8) << (8 - s)) & 0x1FFF
+     * Both shifts are 16-bit multiplications by 2^(8 - s): byte[b] is placed in the high
+     * byte of the lane so that mulhi shifts it right.
+     * quot = word * 5762 >> 19 is exact for 13-bit words, rem = word - 91 * quot.
+     * Symbol of digit i is 127 - i except for digits 0, 35 and 88.
+     */
+#define BASE91X_ENCODE_CONSTANTS(set, set1) \
+        const auto low_shuffle = set(11, -128, 9, -128, 8, -128, 6, -128, 4, -128, 3, -128, 1, -128, 0, -128); \
+        const auto high_shuffle = set(13, 12, 11, 10, 10, 9, 8, 7, 6, 5, 5, 4, 3, 2, 2, 1); \
+        const auto shift = set(0, 32, 0, 4, 0, -128, 0, 16, 0, 2, 0, 64, 0, 8, 1, 0); \
+        const auto word_mask = set(0x1F, -1, 0x1F, -1, 0x1F, -1, 0x1F, -1, 0x1F, -1, 0x1F, -1, 0x1F, -1, 0x1F, -1); \
+        const auto magic = set(0x16, -0x7E, 0x16, -0x7E, 0x16, -0x7E, 0x16, -0x7E, 0x16, -0x7E, 0x16, -0x7E, 0x16, -0x7E, 0x16, -0x7E); \
+        const auto base = set(0, 91, 0, 91, 0, 91, 0, 91, 0, 91, 0, 91, 0, 91, 0, 91); \
+        const auto digit_0 = set1(0); \
+        const auto digit_35 = set1(35); \
+        const auto digit_88 = set1(88)
+
+    /*
+     * Decoding: digit = 127 - symbol with the same three exceptions; symbols
+     * below '!', '"', '\'', '\\' and DEL are out of the alphabet. A block with
+     * such a symbol or with a word above 13 bits is left to the scalar kernel.
+     * Words are merged with multiply-add into 26-bit, then 52-bit lanes and
+     * the two 52-bit halves of a block are byte-shuffled into 13 bytes.
+     */
+#define BASE91X_DECODE_CONSTANTS(set, set1) \
+        const auto pair = set(91, 1, 91, 1, 91, 1, 91, 1, 91, 1, 91, 1, 91, 1, 91, 1); \
+        const auto word_max = set(0x1F, -1, 0x1F, -1, 0x1F, -1, 0x1F, -1, 0x1F, -1, 0x1F, -1, 0x1F, -1, 0x1F, -1); \
+        const auto merge = set(0x20, 0, 0, 1, 0x20, 0, 0, 1, 0x20, 0, 0, 1, 0x20, 0, 0, 1); \
+        const auto low_half = set(0, 0, 0, 0, -1, -1, -1, -1, 0, 0, 0, 0, -1, -1, -1, -1); \
+        const auto first_half = set(-128, -128, -128, -128, -128, -128, -128, -128, -128, 6, 5, 4, 3, 2, 1, 0); \
+        const auto second_half = set(-128, -128, -128, 14, 13, 12, 11, 10, 9, 8, -128, -128, -128, -128, -128, -128); \
+        const auto symbol_min = set1(33); \
+        const auto symbol_0 = set1(33); \
+        const auto symbol_34 = set1(34); \
+        const auto symbol_35 = set1(35); \
+        const auto symbol_88 = set1(36); \
+        const auto symbol_39 = set1(39); \
+        const auto symbol_92 = set1(92)
+
+#define BASE91X_FIX_CONSTANTS(set1) \
+        const auto value_127 = set1(127); \
+        const auto fix_0 = set1(33 - 127); \
+        const auto fix_35 = set1(35 - 92); \
+        const auto fix_88 = set1(36 - 39)
+
+#define BASE91X_SET_X2(...) _mm256_broadcastsi128_si256(_mm_set_epi8(__VA_ARGS__))
+
+    __attribute__((target("ssse3")))
+    static size_t encode_blocks_ssse3(const unsigned char *data, size_t size, char *text)
+    {
+        BASE91X_ENCODE_CONSTANTS(_mm_set_epi8, _mm_set1_epi8);
+        BASE91X_FIX_CONSTANTS(_mm_set1_epi8);
+        size_t consumed = 0;
+        // 16-byte loads, the last 3 bytes belong to the next block
+        for (; consumed + block_symbols <= size; consumed += block_size, text += block_symbols)
+        {
+            const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + consumed));
+            const __m128i low = _mm_shuffle_epi8(bytes, low_shuffle);
+            const __m128i high = _mm_shuffle_epi8(bytes, high_shuffle);
+            const __m128i word = _mm_and_si128(word_mask,
+                _mm_or_si128(_mm_mulhi_epu16(low, shift), _mm_mullo_epi16(high, shift)));
+            const __m128i quot = _mm_srli_epi16(_mm_mulhi_epu16(word, magic), 3);
+            const __m128i rem = _mm_sub_epi16(word, _mm_mullo_epi16(quot, base));
+            const __m128i digits = _mm_or_si128(rem, _mm_slli_epi16(quot, 8));
+            __m128i symbols = _mm_sub_epi8(value_127, digits);
+            symbols = _mm_add_epi8(symbols, _mm_and_si128(_mm_cmpeq_epi8(digits, digit_0), fix_0));
+            symbols = _mm_add_epi8(symbols, _mm_and_si128(_mm_cmpeq_epi8(digits, digit_35), fix_35));
+            symbols = _mm_add_epi8(symbols, _mm_and_si128(_mm_cmpeq_epi8(digits, digit_88), fix_88));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(text), symbols);
+        }
+        return consumed;
+    }
+
+    __attribute__((target("ssse3")))
+    static size_t decode_blocks_ssse3(const char *text, size_t size, unsigned char *data)
+    {
+        BASE91X_DECODE_CONSTANTS(_mm_set_epi8, _mm_set1_epi8);
+        BASE91X_FIX_CONSTANTS(_mm_set1_epi8);
+        size_t consumed = 0;
+        // 16-byte stores, the last 3 bytes are overwritten by the next block
+        for (; consumed + 2 * block_symbols <= size; consumed += block_symbols, data += block_size)
+        {
+            const __m128i symbols = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + consumed));
+            const __m128i invalid = _mm_or_si128(
+                _mm_or_si128(_mm_cmplt_epi8(symbols, symbol_min), _mm_cmpeq_epi8(symbols, value_127)),
+                _mm_or_si128(_mm_cmpeq_epi8(symbols, symbol_34),
+                    _mm_or_si128(_mm_cmpeq_epi8(symbols, symbol_39), _mm_cmpeq_epi8(symbols, symbol_92))));
+            __m128i digits = _mm_sub_epi8(value_127, symbols);
+            digits = _mm_add_epi8(digits, _mm_and_si128(_mm_cmpeq_epi8(symbols, symbol_0), fix_0));
+            digits = _mm_add_epi8(digits, _mm_and_si128(_mm_cmpeq_epi8(symbols, symbol_35), fix_35));
+            digits = _mm_add_epi8(digits, _mm_and_si128(_mm_cmpeq_epi8(symbols, symbol_88), fix_88));
+            const __m128i words = _mm_maddubs_epi16(digits, pair);
+            if (_mm_movemask_epi8(_mm_or_si128(invalid, _mm_cmpgt_epi16(words, word_max))))
+            {
+                break;
+            }
+            const __m128i dwords = _mm_madd_epi16(words, merge);
+            const __m128i qwords = _mm_or_si128(_mm_and_si128(low_half, dwords),
+                _mm_slli_epi64(_mm_srli_epi64(dwords, 32), 26));
+            const __m128i bytes = _mm_or_si128(_mm_shuffle_epi8(qwords, first_half),
+                _mm_shuffle_epi8(_mm_slli_epi64(qwords, 4), second_half));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(data), bytes);
+        }
+        return consumed;
+    }
+
+    __attribute__((target("avx2")))
+    static size_t encode_blocks_avx2(const unsigned char *data, size_t size, char *text)
+    {
+        BASE91X_ENCODE_CONSTANTS(BASE91X_SET_X2, _mm256_set1_epi8);
+        BASE91X_FIX_CONSTANTS(_mm256_set1_epi8);
+        size_t consumed = 0;
+        // One block per 128-bit lane
+        for (; consumed + block_size + block_symbols <= size; consumed += 2 * block_size, text += 2 * block_symbols)
+        {
+            const __m256i bytes = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + consumed))),
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + consumed + block_size)), 1);
+            const __m256i low = _mm256_shuffle_epi8(bytes, low_shuffle);
+            const __m256i high = _mm256_shuffle_epi8(bytes, high_shuffle);
+            const __m256i word = _mm256_and_si256(word_mask,
+                _mm256_or_si256(_mm256_mulhi_epu16(low, shift), _mm256_mullo_epi16(high, shift)));
+            const __m256i quot = _mm256_srli_epi16(_mm256_mulhi_epu16(word, magic), 3);
+            const __m256i rem = _mm256_sub_epi16(word, _mm256_mullo_epi16(quot, base));
+            const __m256i digits = _mm256_or_si256(rem, _mm256_slli_epi16(quot, 8));
+            __m256i symbols = _mm256_sub_epi8(value_127, digits);
+            symbols = _mm256_add_epi8(symbols, _mm256_and_si256(_mm256_cmpeq_epi8(digits, digit_0), fix_0));
+            symbols = _mm256_add_epi8(symbols, _mm256_and_si256(_mm256_cmpeq_epi8(digits, digit_35), fix_35));
+            symbols = _mm256_add_epi8(symbols, _mm256_and_si256(_mm256_cmpeq_epi8(digits, digit_88), fix_88));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(text), symbols);
+        }
+        return consumed + encode_blocks_ssse3(data + consumed, size - consumed, text);
+    }
+
+    __attribute__((target("avx2")))
+    static size_t decode_blocks_avx2(const char *text, size_t size, unsigned char *data)
+    {
+        BASE91X_DECODE_CONSTANTS(BASE91X_SET_X2, _mm256_set1_epi8);
+        BASE91X_FIX_CONSTANTS(_mm256_set1_epi8);
+        size_t consumed = 0;
+        // One block per 128-bit lane, 16-byte stores as in decode_blocks_ssse3()
+        for (; consumed + 3 * block_symbols <= size; consumed += 2 * block_symbols, data += 2 * block_size)
+        {
+            const __m256i symbols = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + consumed));
+            const __m256i invalid = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpgt_epi8(symbol_min, symbols), _mm256_cmpeq_epi8(symbols, value_127)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(symbols, symbol_34),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(symbols, symbol_39), _mm256_cmpeq_epi8(symbols, symbol_92))));
+            __m256i digits = _mm256_sub_epi8(value_127, symbols);
+            digits = _mm256_add_epi8(digits, _mm256_and_si256(_mm256_cmpeq_epi8(symbols, symbol_0), fix_0));
+            digits = _mm256_add_epi8(digits, _mm256_and_si256(_mm256_cmpeq_epi8(symbols, symbol_35), fix_35));
+            digits = _mm256_add_epi8(digits, _mm256_and_si256(_mm256_cmpeq_epi8(symbols, symbol_88), fix_88));
+            const __m256i words = _mm256_maddubs_epi16(digits, pair);
+            if (_mm256_movemask_epi8(_mm256_or_si256(invalid, _mm256_cmpgt_epi16(words, word_max))))
+            {
+                break;
+            }
+            const __m256i dwords = _mm256_madd_epi16(words, merge);
+            const __m256i qwords = _mm256_or_si256(_mm256_and_si256(low_half, dwords),
+                _mm256_slli_epi64(_mm256_srli_epi64(dwords, 32), 26));
+            const __m256i bytes = _mm256_or_si256(_mm256_shuffle_epi8(qwords, first_half),
+                _mm256_shuffle_epi8(_mm256_slli_epi64(qwords, 4), second_half));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(data), _mm256_castsi256_si128(bytes));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(data + block_size), _mm256_extracti128_si256(bytes, 1));
+        }
+        return consumed + decode_blocks_ssse3(text + consumed, size - consumed, data);
+    }
+
+#undef BASE91X_ENCODE_CONSTANTS
+#undef BASE91X_DECODE_CONSTANTS
+#undef BASE91X_FIX_CONSTANTS
+#undef BASE91X_SET_X2
+#endif
+
+    static encode_kernel select_encode_kernel()
+    {
+#if BASE91X_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return encode_blocks_avx2;
+        if (__builtin_cpu_supports("ssse3"))
+            return encode_blocks_ssse3;
+#endif
+        return encode_blocks_none;
+    }
+
+    static decode_kernel select_decode_kernel()
+    {
+#if BASE91X_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return decode_blocks_avx2;
+        if (__builtin_cpu_supports("ssse3"))
+            return decode_blocks_ssse3;
+#endif
+        return decode_blocks_none;
     }
 };
 
@@ -0,0 +1,528 @@
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <fmt/format.h>
+#include "config.hpp"
+#include "loopback_transport.hpp"
+#include "metrics_server.hpp"
+#include "packet_device.hpp"
+#include "process_usage.hpp"
+#include "text_codec.hpp"
+#include "transport.hpp"
+#include "tunnel.hpp"
+#include "utils.hpp"
+
+
+/**
+ * Transport decorator that counts messages and encoded bytes sent through it.
+ */
+class MeteredTransport : public Transport {
+    Transport & _inner;
+
+public:
+    std::atomic<size_t> messages{0};
+    std::atomic<size_t> encoded_bytes{0};
+    std::atomic<size_t> encoded_chars{0};
+    std::atomic<size_t> errors{0};
+    std::atomic<size_t> documents{0};
+
+    explicit MeteredTransport(Transport & inner) : _inner(inner) {
+        _inner.setMessageHandler([this](const ReceivedMessage & message) {
+            _deliverMessage(message);
+        });
+    }
+
+    void sendTextMessage(std::int64_t chat_id, std::string text, SendHandler handler) override {
+        messages++;
+        encoded_bytes += text.size();
+        encoded_chars += LoopbackLink::utf16Length(text);
+        _inner.sendTextMessage(chat_id, std::move(text), [this, handler = std::move(handler)](const SendResult & result) {
+            if (!result.ok) {
+                errors++;
+            }
+            if (handler) {
+                handler(result);
+            }
+        });
+    }
+
+    bool supportsDocuments() const override {
+        return _inner.supportsDocuments();
+    }
+
+    void sendDocument(std::int64_t chat_id, std::string caption, std::string data, SendHandler handler) override {
+        messages++;
+        documents++;
+        encoded_bytes += caption.size() + data.size();
+        encoded_chars += LoopbackLink::utf16Length(caption);
+        _inner.sendDocument(chat_id, std::move(caption), std::move(data), [this, handler = std::move(handler)](const SendResult & result) {
+            if (!result.ok) {
+                errors++;
+            }
+            if (handler) {
+                handler(result);
+            }
+        });
+    }
+};
+
+
+/**
+ * Synthetic IPv4 traffic. Every packet ends with a stamp of its send time
+ * so the receiver can measure one-way latency.
+ */
+class TrafficGenerator {
+public:
+    static constexpr size_t STAMP_SIZE = sizeof(int64_t);
+
+    enum class Profile { ack, bulk, dns, tls, mix };
+
+    static Profile parseProfile(const std::string & name) {
+        if (name == "ack") return Profile::ack;
+        if (name == "bulk") return Profile::bulk;
+        if (name == "dns") return Profile::dns;
+        if (name == "tls") return Profile::tls;
+        if (name == "mix") return Profile::mix;
+        throw std::runtime_error(fmt::format("Unknown traffic profile: {}", name));
+    }
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /** IPv4 and TCP header with timestamps */
+    static constexpr size_t TCP_HEADERS_SIZE = 20 + 32;
+
+    /**
+     * Build IPv4 packet of given protocol and total size with stamp at the end,
+     * TCP packets are segments of one connection
+     */
+    static std::string makePacket(uint8_t protocol, size_t size, uint32_t sequence) {
+        size = std::max(size, (protocol == 6 ? TCP_HEADERS_SIZE : 20 + 8) + STAMP_SIZE);
+        std::string packet(size, '\0');
+        auto * p = reinterpret_cast<uint8_t *>(packet.data());
+        p[0] = 0x45;
+        p[2] = (uint8_t) (size >> 8);
+        p[3] = (uint8_t) size;
+        p[4] = (uint8_t) (sequence >> 8);
+        p[5] = (uint8_t) sequence;
+        p[8] = 64;
+        p[9] = protocol;
+        uint8_t src[4] = {10, 0, 0, 2};
+        uint8_t dst[4] = {10, 0, 0, 1};
+        std::memcpy(p + 12, src, 4);
+        std::memcpy(p + 16, dst, 4);
+        if (protocol == 6) {
+            p[21] = 0xD0; // 53456
+            p[23] = 80;
+            HeaderCompression::set32(p + 24, sequence * 1448);
+            HeaderCompression::set32(p + 28, sequence * 1448);
+            p[32] = 0x80;
+            p[33] = 0x10; // ACK
+            p[34] = 0xFF;
+            // NOP, NOP, timestamps
+            uint8_t options[4] = {1, 1, 8, 10};
+            std::memcpy(p + 40, options, 4);
+            HeaderCompression::set32(p + 44, sequence);
+            HeaderCompression::set32(p + 48, sequence);
+        } else {
+            p[21] = 0xD1;
+            p[23] = 53;
+            p[24] = (uint8_t) ((size - 20) >> 8);
+            p[25] = (uint8_t) (size - 20);
+        }
+        return packet;
+    }
+
+    /**
+     * Stamp packet with the current time and fill its checksums
+     */
+    static void stamp(std::string & packet) {
+        auto time = now();
+        std::memcpy(packet.data() + packet.size() - sizeof(time), &time, sizeof(time));
+        auto * p = reinterpret_cast<uint8_t *>(packet.data());
+        HeaderCompression::finish(p, packet.size(), p[9]);
+    }
+
+    static int64_t stampTime(const char * packet, size_t size) {
+        int64_t time;
+        std::memcpy(&time, packet + size - sizeof(time), sizeof(time));
+        return time;
+    }
+
+    Profile profile;
+    std::mt19937 random{42};
+
+    explicit TrafficGenerator(Profile profile) : profile(profile) {}
+
+    /**
+     * Next burst of packets to inject back-to-back
+     */
+    std::vector<std::string> next(uint32_t & sequence) {
+        std::vector<std::string> burst;
+        auto kind = profile;
+        if (kind == Profile::mix) {
+            auto roll = std::uniform_int_distribution<int>(0, 99)(random);
+            kind = roll < 50 ? Profile::ack : roll < 90 ? Profile::bulk : Profile::dns;
+        }
+        switch (kind) {
+            case Profile::ack:
+                burst.push_back(makePacket(6, TCP_HEADERS_SIZE + STAMP_SIZE, sequence++));
+                break;
+            case Profile::bulk:
+                burst.push_back(makePacket(6, 1500, sequence++));
+                break;
+            case Profile::tls:
+            {
+                // Encrypted payload does not compress
+                auto packet = makePacket(6, 1500, sequence++);
+                for (size_t i = TCP_HEADERS_SIZE; i < packet.size(); i++) {
+                    packet[i] = (char) random();
+                }
+                burst.push_back(std::move(packet));
+                break;
+            }
+            case Profile::dns:
+            default:
+                for (int i = 0; i < 8; i++) {
+                    auto size = std::uniform_int_distribution<size_t>(60, 120)(random);
+                    burst.push_back(makePacket(17, size, sequence++));
+                }
+                break;
+        }
+        return burst;
+    }
+};
+
+
+/**
+ * Codec throughput on message-sized batches of random data
+ */
+static void benchCodec(TextCodec::Type codec, size_t batch_size, double duration_s) {
+    std::mt19937 random{42};
+    std::string data(batch_size, '\0');
+    for (auto & c : data) {
+        c = (char) random();
+    }
+    std::string text(TextCodec::encodedSize(codec, data.size()), '\0');
+    std::string decoded(TextCodec::maxDecodedSize(codec, text.size()), '\0');
+
+    auto measure = [duration_s](auto && step) {
+        size_t iterations = 0;
+        auto begin = std::chrono::steady_clock::now();
+        auto end = begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(duration_s));
+        while (std::chrono::steady_clock::now() < end) {
+            for (int i = 0; i < 64; i++) {
+                step();
+            }
+            iterations += 64;
+        }
+        return (double) iterations / std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    };
+
+    size_t text_size = 0;
+    auto encodes = measure([&]() { text_size = TextCodec::encode(codec, data.data(), data.size(), text.data()); });
+    size_t decoded_size = 0;
+    auto decodes = measure([&]() { decoded_size = TextCodec::decode(codec, text.data(), text_size, decoded.data()); });
+    if (decoded_size != data.size() || std::memcmp(decoded.data(), data.data(), data.size()) != 0) {
+        throw std::runtime_error(fmt::format("{} round trip mismatch", TextCodec::name(codec)));
+    }
+    println("{}, {} byte batches: encode {:.3f} GB/s, decode {:.3f} GB/s",
+        TextCodec::name(codec), batch_size, encodes * (double) batch_size / 1e9, decodes * (double) batch_size / 1e9);
+}
+
+
+static double percentile(std::vector<int64_t> & sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    auto index = std::min(sorted.size() - 1, (size_t) (p * (double) sorted.size()));
+    return (double) sorted[index] / 1e6;
+}
+
+
+int main(int argc, char * argv[]) {
+    namespace po = boost::program_options;
+
+    try {
+        double duration_s;
+        double pps;
+        std::string traffic;
+        std::string text_codec;
+        std::string compression;
+        bool header_compression;
+        float cache_flush_rate;
+        float flush_latency_ms;
+        float flush_min_fill;
+        float reorder_timeout_ms;
+        float send_rate;
+        int64_t latency_us;
+        int64_t jitter_us;
+        size_t max_message_size;
+        float max_messages_per_second;
+        double error_rate;
+        float retransmit_deadline_ms;
+        size_t document_min_bytes;
+        double document_bytes_per_second;
+        int metrics_port;
+        size_t lanes;
+        size_t tun_queues;
+
+        po::options_description desc("Allowed options");
+        desc.add_options()
+            ("duration", po::value(&duration_s)->default_value(10), "seconds of traffic to inject")
+            ("pps", po::value(&pps)->default_value(1000), "offered packet bursts per second, 0 for unlimited")
+            ("traffic", po::value(&traffic)->default_value("mix"), "traffic profile: ack, bulk, dns, tls or mix")
+            ("text_codec", po::value(&text_codec)->default_value("base91x"), "message codec: base91x or base32768")
+            ("compression", po::value(&compression)->default_value("none"), "batch compression: none, lz4 or zstd")
+            ("header_compression", po::bool_switch(&header_compression), "compress IPv4 TCP/UDP headers per flow")
+            ("cache_flush_rate", po::value(&cache_flush_rate)->default_value(10), "tunnel cache flush rate, 0 sends one message per packet")
+            ("flush_latency_ms", po::value(&flush_latency_ms)->default_value(0), "tunnel latency target, 0 for 1000 / cache_flush_rate")
+            ("flush_min_fill", po::value(&flush_min_fill)->default_value(0.5f), "tunnel message fill ratio sent without waiting")
+            ("reorder_timeout_ms", po::value(&reorder_timeout_ms)->default_value(200), "receiver wait for a missing message, 0 to never wait")
+            ("send_rate", po::value(&send_rate)->default_value(20), "tunnel send budget, messages per second, 0 for unlimited")
+            ("latency", po::value(&latency_us)->default_value(0), "simulated one-way Telegram latency, us")
+            ("jitter", po::value(&jitter_us)->default_value(0), "simulated Telegram latency jitter, us")
+            ("max_message_size", po::value(&max_message_size)->default_value(0), "simulated message length limit, 0 for unlimited")
+            ("max_messages_per_second", po::value(&max_messages_per_second)->default_value(0), "simulated FLOOD_WAIT threshold, 0 for unlimited")
+            ("error_rate", po::value(&error_rate)->default_value(0), "simulated fraction of sends failing with a transient error")
+            ("retransmit_deadline_ms", po::value(&retransmit_deadline_ms)->default_value(2000), "tunnel retransmit deadline, 0 to never retransmit")
+            ("document_min_bytes", po::value(&document_min_bytes)->default_value(0), "tunnel backlog sent as documents, 0 to always send text")
+            ("document_bytes_per_second", po::value(&document_bytes_per_second)->default_value(0), "simulated document upload rate, 0 for unlimited")
+            ("lanes", po::value(&lanes)->default_value(1), "accounts to stripe messages across, each with its own rate limits")
+            ("tun_queues", po::value(&tun_queues)->default_value(1), "device queues per tunnel, each with reader and writer threads")
+            ("metrics_port", po::value(&metrics_port)->default_value(0), "serve client tunnel metrics on 127.0.0.1:port, 0 to disable")
+            ("codec", "benchmark only the text codec and exit")
+            ("help", "show help message and exit")
+            ;
+
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+
+        if (vm.count("help")) {
+            std::cerr << desc << std::endl;
+            return 1;
+        }
+
+        if (vm.count("codec")) {
+            for (auto codec : {TextCodec::BASE91X, TextCodec::BASE32768}) {
+                benchCodec(codec, 3300, duration_s / 4);
+                benchCodec(codec, 1 << 20, duration_s / 4);
+            }
+            return 0;
+        }
+
+        LoopbackOptions options;
+        options.latency = std::chrono::microseconds(latency_us);
+        options.jitter = std::chrono::microseconds(jitter_us);
+        options.max_message_size = max_message_size;
+        options.max_messages_per_second = max_messages_per_second;
+        options.error_rate = error_rate;
+        options.document_bytes_per_second = document_bytes_per_second;
+        lanes = std::max<size_t>(lanes, 1);
+        std::vector<std::unique_ptr<LoopbackLink>> links;
+        for (size_t i = 0; i < lanes; i++) {
+            links.push_back(std::make_unique<LoopbackLink>(options, (std::int64_t) (2 * i + 1), (std::int64_t) (2 * i + 2)));
+        }
+
+        Config config;
+        config.tun.mtu = 1500;
+        config.cache_flush_rate = cache_flush_rate;
+        config.flush_latency_ms = flush_latency_ms;
+        config.flush_min_fill = flush_min_fill;
+        config.reorder_timeout_ms = reorder_timeout_ms;
+        config.retransmit_deadline_ms = retransmit_deadline_ms;
+        config.document_min_bytes = document_min_bytes;
+        config.max_messages_per_second = send_rate;
+        config.wrap_in_proxy = false;
+        config.codec = text_codec;
+        config.compression = compression;
+        config.header_compression = header_compression;
+
+        // Like the kernel does for a multiqueue TUN device, the host side steers every flow to one queue
+        tun_queues = std::max<size_t>(tun_queues, 1);
+        std::vector<std::unique_ptr<PipeDevice>> client_devices;
+        std::vector<std::unique_ptr<PipeDevice>> server_devices;
+        std::vector<PacketDevice *> client_queues;
+        std::vector<PacketDevice *> server_queues;
+        for (size_t i = 0; i < tun_queues; i++) {
+            client_devices.push_back(std::make_unique<PipeDevice>());
+            client_queues.push_back(client_devices.back().get());
+            server_devices.push_back(std::make_unique<PipeDevice>());
+            server_queues.push_back(server_devices.back().get());
+        }
+
+        std::vector<std::unique_ptr<MeteredTransport>> client_transports;
+        std::vector<Transport *> transports;
+        config.tun.name = "bench_client";
+        config.lanes.clear();
+        for (auto & link : links) {
+            client_transports.push_back(std::make_unique<MeteredTransport>(link->first()));
+            transports.push_back(client_transports.back().get());
+            config.lanes.push_back(LaneConfig{{}, link->second().userId(), link->second().userId()});
+        }
+        Tunnel client(config, client_queues, transports);
+
+        transports.clear();
+        config.tun.name = "bench_server";
+        config.lanes.clear();
+        for (auto & link : links) {
+            transports.push_back(&link->second());
+            config.lanes.push_back(LaneConfig{{}, link->first().userId(), link->first().userId()});
+        }
+        Tunnel server(config, server_queues, transports);
+
+        client.start();
+        std::unique_ptr<MetricsServer> metrics;
+        if (metrics_port) {
+            metrics = std::make_unique<MetricsServer>("127.0.0.1", metrics_port, [&client]() { return client.metrics(); });
+            metrics->start();
+        }
+        server.start();
+
+        std::atomic<bool> receiving{true};
+        std::atomic<size_t> sent_packets{0};
+        std::atomic<size_t> sent_bytes{0};
+        std::atomic<size_t> received_packets{0};
+        std::atomic<size_t> received_bytes{0};
+        std::atomic<size_t> corrupted_packets{0};
+        std::atomic<size_t> reordered_packets{0};
+        std::vector<int64_t> latencies;
+        /** Latencies of DNS packets, which share the link with bulk TCP in the mix profile */
+        std::vector<int64_t> dns_latencies;
+        auto last_received = std::chrono::steady_clock::now();
+
+        std::thread receiver([&]() {
+            std::vector<char> buffer(65536);
+            std::vector<pollfd> pfds;
+            for (auto & device : server_devices) {
+                pfds.push_back({device->hostHandle(), POLLIN, 0});
+            }
+            uint16_t last_id = 0;
+            size_t next = 0;
+            while (receiving) {
+                if (poll(pfds.data(), pfds.size(), 100) <= 0) {
+                    continue;
+                }
+                // One packet per ready queue in turn
+                for (size_t i = 0; i < pfds.size() && !(pfds[next].revents & POLLIN); i++) {
+                    next = (next + 1) % pfds.size();
+                }
+                auto fd = pfds[next].fd;
+                next = (next + 1) % pfds.size();
+                auto n = ::read(fd, buffer.data(), buffer.size());
+                if (n < (ssize_t) TrafficGenerator::STAMP_SIZE) {
+                    continue;
+                }
+                latencies.push_back(TrafficGenerator::now() - TrafficGenerator::stampTime(buffer.data(), n));
+                auto * p = reinterpret_cast<const uint8_t *>(buffer.data());
+                if (p[9] == HeaderCompression::PROTOCOL_UDP) {
+                    dns_latencies.push_back(latencies.back());
+                }
+                if (HeaderCompression::checksum(HeaderCompression::sum(p, HeaderCompression::IP_HEADER_SIZE))
+                        || HeaderCompression::transportChecksum(p, n)) {
+                    corrupted_packets++;
+                }
+                // Packets are injected with increasing IPv4 identification
+                uint16_t id = (uint16_t) (p[4] << 8 | p[5]);
+                if (received_packets && (int16_t) (id - last_id) < 0) {
+                    reordered_packets++;
+                }
+                last_id = id;
+                received_packets++;
+                received_bytes += n;
+                last_received = std::chrono::steady_clock::now();
+            }
+        });
+
+        TrafficGenerator generator(TrafficGenerator::parseProfile(traffic));
+        uint32_t sequence = 0;
+        auto begin = std::chrono::steady_clock::now();
+        auto end = begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(duration_s));
+        auto next_burst = begin;
+        while (std::chrono::steady_clock::now() < end) {
+            if (pps > 0) {
+                std::this_thread::sleep_until(next_burst);
+                next_burst += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1. / pps));
+            }
+            for (auto & packet : generator.next(sequence)) {
+                TrafficGenerator::stamp(packet);
+                bool control;
+                auto queue = FlowQueue<int>::flowHash(std::string_view(packet.data(), packet.size()), control) % tun_queues;
+                if (::write(client_devices[queue]->hostHandle(), packet.data(), packet.size()) == (ssize_t) packet.size()) {
+                    sent_packets++;
+                    sent_bytes += packet.size();
+                }
+            }
+        }
+        auto offered_elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        // Let queued and in-flight packets arrive until nothing moves for a while
+        auto idle = std::chrono::milliseconds(500) + options.latency + options.jitter
+            + std::chrono::milliseconds(cache_flush_rate > 0 ? int64_t(2000.f / cache_flush_rate) : 0);
+        for (size_t last = SIZE_MAX; last != received_packets && received_packets < sent_packets; ) {
+            last = received_packets;
+            std::this_thread::sleep_for(idle);
+        }
+        receiving = false;
+        receiver.join();
+        client.stop();
+        server.stop();
+
+        std::sort(latencies.begin(), latencies.end());
+        std::sort(dns_latencies.begin(), dns_latencies.end());
+        size_t messages = 0;
+        size_t encoded_bytes = 0;
+        size_t encoded_chars = 0;
+        size_t errors = 0;
+        size_t documents = 0;
+        for (auto & transport : client_transports) {
+            messages += transport->messages;
+            encoded_bytes += transport->encoded_bytes;
+            encoded_chars += transport->encoded_chars;
+            errors += transport->errors;
+            documents += transport->documents;
+        }
+        println("");
+        println("traffic: {}, offered: {} bursts/s, duration: {:.2f} s, cache_flush_rate: {}, codec: {}, compression: {}, header_compression: {}, lanes: {}",
+            traffic, pps, offered_elapsed, cache_flush_rate, text_codec, compression, header_compression, lanes);
+        println("sent: {} packets, {} bytes; received: {} packets, {} bytes ({:.2f}% loss), corrupted: {} packets, reordered: {} packets",
+            sent_packets, sent_bytes, received_packets, received_bytes,
+            sent_packets ? 100. * (double) (sent_packets - std::min<size_t>(sent_packets, received_packets)) / (double) sent_packets : 0.,
+            corrupted_packets, reordered_packets);
+        // Rates are over the time until the last packet arrived, the TUN reader may lag behind the offer
+        auto elapsed = std::max(std::chrono::duration<double>(last_received - begin).count(), offered_elapsed);
+        println("throughput: {:.0f} packets/s, goodput: {:.3f} Mbit/s",
+            (double) received_packets / elapsed, (double) received_bytes * 8 / elapsed / 1e6);
+        println("messages: {} ({:.1f}/s), documents: {}, send errors: {}, encoded bytes per payload byte: {:.3f}, characters per payload byte: {:.3f}",
+            messages, (double) messages / elapsed, documents, errors,
+            received_bytes ? (double) encoded_bytes / (double) received_bytes : 0.,
+            received_bytes ? (double) encoded_chars / (double) received_bytes : 0.);
+        println("one-way latency: p50 {:.3f} ms, p99 {:.3f} ms, p999 {:.3f} ms",
+            percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999));
+        auto usage = ProcessUsage::current();
+        println("resident memory: {} MiB, disk write bytes per packet: {:.1f}, first packet after {:.3f} s",
+            usage.resident_bytes >> 20, sent_packets ? (double) usage.disk_write_bytes / (double) sent_packets : 0.,
+            server.firstPacketSeconds());
+        if (!dns_latencies.empty() && dns_latencies.size() != latencies.size()) {
+            println("dns one-way latency: p50 {:.3f} ms, p99 {:.3f} ms",
+                percentile(dns_latencies, 0.5), percentile(dns_latencies, 0.99));
+        }
+    } catch (std::exception & e) {
+        println(stderr, "error: {}", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+
+/**
+ * Fixed-size packet buffers shared by the TUN reader, cache and flush paths.
+ * Released buffers return to the pool, so steady state traffic does not
+ * allocate. The pool grows when all buffers are in use and must outlive them.
+ */
+class PacketPool {
+public:
+    /**
+     * Move-only handle of a pooled buffer, returns it to the pool on destruction
+     */
+    class Buffer {
+        friend class PacketPool;
+
+        PacketPool * _pool{nullptr};
+        std::unique_ptr<char[]> _data;
+        size_t _size{0};
+
+        Buffer(PacketPool * pool, std::unique_ptr<char[]> data) : _pool(pool), _data(std::move(data)) {}
+
+    public:
+        Buffer() = default;
+        Buffer(Buffer &&) noexcept = default;
+
+        Buffer & operator=(Buffer && other) noexcept {
+            if (this != &other) {
+                _release();
+                _pool = other._pool;
+                _data = std::move(other._data);
+                _size = other._size;
+            }
+            return *this;
+        }
+
+        ~Buffer() {
+            _release();
+        }
+
+        char * data() {
+            return _data.get();
+        }
+
+        const char * data() const {
+            return _data.get();
+        }
+
+        size_t size() const {
+            return _size;
+        }
+
+        size_t capacity() const {
+            return _pool ? _pool->_buffer_size : 0;
+        }
+
+        void resize(size_t size) {
+            _size = size;
+        }
+
+        operator std::string_view() const {
+            return {_data.get(), _size};
+        }
+
+    private:
+        void _release() {
+            if (_data) {
+                _pool->_release(std::move(_data));
+            }
+        }
+    };
+
+private:
+    size_t _buffer_size;
+    std::mutex _mutex;
+    std::vector<std::unique_ptr<char[]>> _free;
+
+public:
+    PacketPool(size_t buffer_size, size_t preallocate) : _buffer_size(buffer_size) {
+        _free.reserve(preallocate);
+        for (size_t i = 0; i < preallocate; i++) {
+            _free.emplace_back(new char[_buffer_size]);
+        }
+    }
+
+    PacketPool(const PacketPool &) = delete;
+    PacketPool & operator=(const PacketPool &) = delete;
+
+    size_t bufferSize() const {
+        return _buffer_size;
+    }
+
+    Buffer acquire() {
+        {
+            std::scoped_lock lock(_mutex);
+            if (!_free.empty()) {
+                auto data = std::move(_free.back());
+                _free.pop_back();
+                return Buffer(this, std::move(data));
+            }
+        }
+        return Buffer(this, std::unique_ptr<char[]>(new char[_buffer_size]));
+    }
+
+private:
+    void _release(std::unique_ptr<char[]> data) {
+        std::scoped_lock lock(_mutex);
+        _free.push_back(std::move(data));
+    }
+};
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#ifdef IOT_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef IOT_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+
+/**
+ * Optional compression of message payloads, LZ4 and zstd are available when
+ * built with IOT_HAVE_LZ4 and IOT_HAVE_ZSTD.
+ * Both use the same built-in dictionary of typical IPv4/IPv6, TCP, UDP, DNS,
+ * ICMP, TLS and HTTP headers, so small batches compress too.
+ *
+ * compress() is called by the sending thread and decompress() by the
+ * receiving thread, each one uses its own contexts.
+ */
+class Compressor {
+public:
+    enum Type {
+        NONE,
+        LZ4,
+        ZSTD,
+    };
+
+    /** Payloads of this size and more are not compressed above ENTROPY_MAX bits per byte */
+    static constexpr size_t ENTROPY_MIN_SIZE = 512;
+    static constexpr double ENTROPY_MAX = 7.5;
+    static constexpr int ZSTD_LEVEL = 3;
+
+private:
+    Type _type;
+#ifdef IOT_HAVE_LZ4
+    LZ4_stream_t * _lz4{nullptr};
+#endif
+#ifdef IOT_HAVE_ZSTD
+    ZSTD_CCtx * _zstd_cctx{nullptr};
+    ZSTD_DCtx * _zstd_dctx{nullptr};
+    ZSTD_CDict * _zstd_cdict{nullptr};
+    ZSTD_DDict * _zstd_ddict{nullptr};
+#endif
+
+public:
+    static Type parse(std::string_view name) {
+        if (name == "none") {
+            return NONE;
+        }
+        if (name == "lz4") {
+            if (!available(LZ4)) {
+                throw std::runtime_error("Built without LZ4 compression");
+            }
+            return LZ4;
+        }
+        if (name == "zstd") {
+            if (!available(ZSTD)) {
+                throw std::runtime_error("Built without zstd compression");
+            }
+            return ZSTD;
+        }
+        throw std::runtime_error("Unknown compression: " + std::string(name));
+    }
+
+    static bool available(Type type) {
+        switch (type) {
+            case NONE:
+                return true;
+            case LZ4:
+#ifdef IOT_HAVE_LZ4
+                return true;
+#else
+                return false;
+#endif
+            case ZSTD:
+#ifdef IOT_HAVE_ZSTD
+                return true;
+#else
+                return false;
+#endif
+        }
+        return false;
+    }
+
+    /**
+     * Shannon entropy of bytes, in bits per byte
+     */
+    static double entropy(std::string_view data) {
+        if (data.empty()) {
+            return 0;
+        }
+        std::array<uint32_t, 256> counts{};
+        for (unsigned char c : data) {
+            counts[c]++;
+        }
+        double bits = 0;
+        for (auto count : counts) {
+            if (count) {
+                auto p = (double) count / (double) data.size();
+                bits -= p * std::log2(p);
+            }
+        }
+        return bits;
+    }
+
+    /**
+     * Whether data looks already compressed or encrypted, such as TLS records
+     */
+    static bool incompressible(std::string_view data) {
+        return data.size() >= ENTROPY_MIN_SIZE && entropy(data) > ENTROPY_MAX;
+    }
+
+    /**
+     * Dictionary shared by all peers, changing it breaks compatibility
+     */
+    static const std::string & dictionary() {
+        static const std::string dictionary = _buildDictionary();
+        return dictionary;
+    }
+
+    explicit Compressor(Type type) : _type(type) {
+#ifdef IOT_HAVE_LZ4
+        _lz4 = LZ4_createStream();
+#endif
+#ifdef IOT_HAVE_ZSTD
+        _zstd_cctx = ZSTD_createCCtx();
+        _zstd_dctx = ZSTD_createDCtx();
+        _zstd_cdict = ZSTD_createCDict(dictionary().data(), dictionary().size(), ZSTD_LEVEL);
+        _zstd_ddict = ZSTD_createDDict(dictionary().data(), dictionary().size());
+#endif
+    }
+
+    ~Compressor() {
+#ifdef IOT_HAVE_LZ4
+        LZ4_freeStream(_lz4);
+#endif
+#ifdef IOT_HAVE_ZSTD
+        ZSTD_freeCCtx(_zstd_cctx);
+        ZSTD_freeDCtx(_zstd_dctx);
+        ZSTD_freeCDict(_zstd_cdict);
+        ZSTD_freeDDict(_zstd_ddict);
+#endif
+    }
+
+    Compressor(const Compressor &) = delete;
+    Compressor & operator=(const Compressor &) = delete;
+
+    Type type() const {
+        return _type;
+    }
+
+    /**
+     * Compress data with the configured type
+     * @return false if compression is off, failed or does not make data smaller
+     */
+    bool compress([[maybe_unused]] std::string_view data, [[maybe_unused]] std::string & out) {
+        switch (_type) {
+            case NONE:
+                return false;
+            case LZ4:
+#ifdef IOT_HAVE_LZ4
+            {
+                out.resize(LZ4_COMPRESSBOUND(data.size()));
+                LZ4_resetStream_fast(_lz4);
+                LZ4_loadDict(_lz4, dictionary().data(), (int) dictionary().size());
+                int size = LZ4_compress_fast_continue(_lz4, data.data(), out.data(), (int) data.size(), (int) out.size(), 1);
+                if (size <= 0 || (size_t) size >= data.size()) {
+                    return false;
+                }
+                out.resize(size);
+                return true;
+            }
+#else
+                return false;
+#endif
+            case ZSTD:
+#ifdef IOT_HAVE_ZSTD
+            {
+                out.resize(ZSTD_compressBound(data.size()));
+                auto size = ZSTD_compress_usingCDict(_zstd_cctx, out.data(), out.size(), data.data(), data.size(), _zstd_cdict);
+                if (ZSTD_isError(size) || size >= data.size()) {
+                    return false;
+                }
+                out.resize(size);
+                return true;
+            }
+#else
+                return false;
+#endif
+        }
+        return false;
+    }
+
+    /**
+     * Decompress data of any available type
+     * @param max_size - limit of decompressed size
+     * @return false if data is malformed, too large or type is not available
+     */
+    bool decompress(Type type, std::string_view data, std::string & out, size_t max_size) {
+        switch (type) {
+            case NONE:
+                out.assign(data);
+                return out.size() <= max_size;
+            case LZ4:
+#ifdef IOT_HAVE_LZ4
+            {
+                out.resize(max_size);
+                int size = LZ4_decompress_safe_usingDict(data.data(), out.data(), (int) data.size(), (int) out.size(),
+                    dictionary().data(), (int) dictionary().size());
+                if (size < 0) {
+                    return false;
+                }
+                out.resize(size);
+                return true;
+            }
+#else
+                return false;
+#endif
+            case ZSTD:
+#ifdef IOT_HAVE_ZSTD
+            {
+                out.resize(max_size);
+                auto size = ZSTD_decompress_usingDDict(_zstd_dctx, out.data(), out.size(), data.data(), data.size(), _zstd_ddict);
+                if (ZSTD_isError(size)) {
+                    return false;
+                }
+                out.resize(size);
+                return true;
+            }
+#else
+                return false;
+#endif
+        }
+        return false;
+    }
+
+private:
+    /**
+     * Sample of a string literal of binary data, which may contain NUL bytes
+     */
+    template <size_t N>
+    static constexpr std::string_view _sample(const char (&literal)[N]) {
+        return {literal, N - 1};
+    }
+
+    static std::string _buildDictionary() {
+        // Most frequent content goes last, closest to the data
+        static const std::array<std::string_view, 12> samples = {
+            // HTTP/1.1 request and response heads
+            "GET / HTTP/1.1\r\nHost: www.\r\nUser-Agent: Mozilla/5.0 (X11; Linux x86_64)\r\nAccept: */*\r\n"
+            "Accept-Encoding: gzip, deflate, br\r\nAccept-Language: en-US,en;q=0.9\r\nConnection: keep-alive\r\n\r\n"
+            "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: \r\nCache-Control: no-cache\r\n"
+            "Date: \r\nServer: nginx\r\n\r\n",
+            // TLS 1.2/1.3 ClientHello and application data record headers
+            _sample("\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03"),
+            _sample("\x17\x03\x03\x00"),
+            // IPv6 TCP header
+            _sample("\x60\x00\x00\x00\x00\x20\x06\x40\xfe\x80\x00\x00\x00\x00\x00\x00"),
+            // IPv4 ICMP echo request
+            _sample("\x45\x00\x00\x54\x00\x00\x40\x00\x40\x01\x00\x00\x0a\x00\x00\x01\x0a\x00\x00\x02"
+                    "\x08\x00\x00\x00\x00\x01\x00\x01"),
+            // IPv4 UDP DNS query and response for an A record
+            _sample("\x45\x00\x00\x3c\x00\x00\x40\x00\x40\x11\x00\x00\x0a\x00\x00\x02\x08\x08\x08\x08"
+                    "\xc3\x50\x00\x35\x00\x28\x00\x00"
+                    "\x00\x00\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00\x03www\x06google\x03" "com\x00\x00\x01\x00\x01"),
+            _sample("\x81\x80\x00\x01\x00\x01\x00\x00\x00\x00\xc0\x0c\x00\x01\x00\x01\x00\x00\x01\x2c\x00\x04"),
+            // IPv4 TCP SYN with MSS, SACK permitted, timestamps and window scale options
+            _sample("\x45\x00\x00\x3c\x00\x00\x40\x00\x40\x06\x00\x00\x0a\x00\x00\x02\x0a\x00\x00\x01"
+                    "\xc3\x50\x01\xbb\x00\x00\x00\x00\x00\x00\x00\x00\xa0\x02\xfa\xf0\x00\x00\x00\x00"
+                    "\x02\x04\x05\xb4\x04\x02\x08\x0a\x00\x00\x00\x00\x00\x00\x00\x00\x01\x03\x03\x07"),
+            // IPv4 TCP PSH/ACK with timestamps
+            _sample("\x45\x00\x05\xdc\x00\x00\x40\x00\x40\x06\x00\x00\x0a\x00\x00\x01\x0a\x00\x00\x02"
+                    "\x01\xbb\xc3\x50\x00\x00\x00\x00\x00\x00\x00\x00\x80\x18\x01\xf5\x00\x00\x00\x00"
+                    "\x01\x01\x08\x0a\x00\x00\x00\x00\x00\x00\x00\x00"),
+            // IPv4 TCP ACK with timestamps, the most common packet of a bulk transfer
+            _sample("\x45\x00\x00\x34\x00\x00\x40\x00\x40\x06\x00\x00\x0a\x00\x00\x02\x0a\x00\x00\x01"
+                    "\xc3\x50\x01\xbb\x00\x00\x00\x00\x00\x00\x00\x00\x80\x10\x01\xf5\x00\x00\x00\x00"
+                    "\x01\x01\x08\x0a\x00\x00\x00\x00\x00\x00\x00\x00"),
+            // Frame headers of 52 and 1500 byte packets
+            _sample("\x34\x00\x45\x00\x00\x34"),
+            _sample("\xdc\x05\x45\x00\x05\xdc"),
+        };
+        std::string dictionary;
+        for (auto sample : samples) {
+            dictionary.append(sample);
+        }
+        return dictionary;
+    }
+};
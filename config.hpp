@@ -0,0 +1,225 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// ryml can be used as a single header, or as a simple library:
+#if defined(RYML_SINGLE_HEADER) // using the single header directly in the executable
+    #define RYML_SINGLE_HDR_DEFINE_NOW
+    #include <ryml_all.hpp>
+#elif defined(RYML_SINGLE_HEADER_LIB) // using the single header from a library
+    #include <ryml_all.hpp>
+#else
+    #include <ryml.hpp>
+    // <ryml_std.hpp> is needed if interop with std containers is
+    // desired; ryml itself does not use any STL container.
+    // For this sample, we will be using std interop, so...
+    #include <ryml_std.hpp> // optional header, provided for std:: interop
+    #include <c4/format.hpp> // needed for the examples below
+#endif
+
+
+struct TDConfig {
+    /** Not passed to TDLib yet, which keeps files in the database directory */
+    std::string files_directory;
+    /** Session and databases, "tdlib" for the first lane and "tdlibN" for lane N if empty */
+    std::string database_directory;
+    std::string token;
+    int api_id{0};
+    std::string api_hash;
+    /** Not passed to TDLib yet, existing sessions are unencrypted */
+    std::string database_encryption_key;
+    /**
+     * "tunnel" keeps only the session, without message, chat and file
+     * databases nor secret chats; "full" keeps them all like a regular client
+     */
+    std::string profile{"tunnel"};
+};
+
+/**
+ * Account and chats of one send lane, messages are striped across lanes
+ */
+struct LaneConfig {
+    TDConfig tdconfig;
+    std::int64_t send_to_chat_id{0};
+    std::int64_t receive_from_user_id{0};
+};
+
+struct TUNConfig {
+    std::string name;
+    int mtu;
+    std::string ip;
+    /** Queues of a multiqueue device, each read and written by threads of its own, 1 for a plain device */
+    size_t queues{1};
+};
+
+class Config {
+public:
+    Config() = default;
+
+    explicit Config(std::string & yaml_str) {
+        parse_config(yaml_str);
+    }
+
+    void parse_config(std::string & yaml_str) {
+        ryml::Tree tree = ryml::parse_in_place(c4::to_substr(yaml_str));
+        ryml::ConstNodeRef root = tree.rootref();
+
+        _parseTDConfig(root["tdconfig"], tdconfig);
+
+        root["tun"]["name"] >> tun.name;
+        root["tun"]["mtu"] >> tun.mtu;
+        root["tun"]["ip"] >> tun.ip;
+        if (root["tun"].has_child("queues")) {
+            root["tun"]["queues"] >> tun.queues;
+        }
+
+        // root["cache_size"] >> cache_size;
+        root["cache_flush_rate"] >> cache_flush_rate;
+        root["wrap_in_proxy"] >> wrap_in_proxy;
+        if (root.has_child("receive_from_user_id")) {
+            root["receive_from_user_id"] >> receive_from_user_id;
+        }
+        if (root.has_child("send_to_chat_id")) {
+            root["send_to_chat_id"] >> send_to_chat_id;
+        }
+        lanes.clear();
+        if (root.has_child("lanes")) {
+            for (ryml::ConstNodeRef node : root["lanes"].children()) {
+                // Lanes share the application and profile, every one is an account of its own
+                LaneConfig lane;
+                lane.tdconfig.api_id = tdconfig.api_id;
+                lane.tdconfig.api_hash = tdconfig.api_hash;
+                lane.tdconfig.profile = tdconfig.profile;
+                if (node.has_child("tdconfig")) {
+                    _parseTDConfig(node["tdconfig"], lane.tdconfig);
+                }
+                node["send_to_chat_id"] >> lane.send_to_chat_id;
+                node["receive_from_user_id"] >> lane.receive_from_user_id;
+                lanes.push_back(lane);
+            }
+            if (lanes.size() == 1 && lanes.front().tdconfig.token.empty()) {
+                lanes.front().tdconfig.token = tdconfig.token;
+            }
+            for (size_t i = 0; i < lanes.size(); i++) {
+                if (lanes[i].tdconfig.token.empty()) {
+                    throw std::runtime_error("Lane " + std::to_string(i) + " needs a tdconfig token of its own");
+                }
+            }
+        } else {
+            lanes.push_back(LaneConfig{tdconfig, send_to_chat_id, receive_from_user_id});
+        }
+        if (root.has_child("codec")) {
+            root["codec"] >> codec;
+        }
+        if (root.has_child("compression")) {
+            root["compression"] >> compression;
+        }
+        if (root.has_child("header_compression")) {
+            root["header_compression"] >> header_compression;
+        }
+        if (root.has_child("ack_thinning")) {
+            root["ack_thinning"] >> ack_thinning;
+        }
+        if (root.has_child("dns_cache_size")) {
+            root["dns_cache_size"] >> dns_cache_size;
+        }
+        if (root.has_child("dns_prefetch")) {
+            root["dns_prefetch"] >> dns_prefetch;
+        }
+        if (root.has_child("flush_latency_ms")) {
+            root["flush_latency_ms"] >> flush_latency_ms;
+        }
+        if (root.has_child("flush_min_fill")) {
+            root["flush_min_fill"] >> flush_min_fill;
+        }
+        if (root.has_child("reorder_timeout_ms")) {
+            root["reorder_timeout_ms"] >> reorder_timeout_ms;
+        }
+        if (root.has_child("retransmit_deadline_ms")) {
+            root["retransmit_deadline_ms"] >> retransmit_deadline_ms;
+        }
+        if (root.has_child("document_min_bytes")) {
+            root["document_min_bytes"] >> document_min_bytes;
+        }
+        if (root.has_child("document_directory")) {
+            root["document_directory"] >> document_directory;
+        }
+        if (root.has_child("max_messages_per_second")) {
+            root["max_messages_per_second"] >> max_messages_per_second;
+        }
+        if (root.has_child("metrics_address")) {
+            root["metrics_address"] >> metrics_address;
+        }
+        if (root.has_child("metrics_port")) {
+            root["metrics_port"] >> metrics_port;
+        }
+    }
+
+private:
+    static void _parseTDConfig(ryml::ConstNodeRef node, TDConfig & config) {
+        if (node.has_child("files_directory")) {
+            node["files_directory"] >> config.files_directory;
+        }
+        if (node.has_child("database_directory")) {
+            node["database_directory"] >> config.database_directory;
+        }
+        if (node.has_child("profile")) {
+            node["profile"] >> config.profile;
+        }
+        if (node.has_child("token")) {
+            node["token"] >> config.token;
+        }
+        if (node.has_child("api_hash")) {
+            node["api_hash"] >> config.api_hash;
+        }
+        if (node.has_child("database_encryption_key")) {
+            node["database_encryption_key"] >> config.database_encryption_key;
+        }
+        if (node.has_child("api_id")) {
+            node["api_id"] >> config.api_id;
+        }
+    }
+
+public:
+    TDConfig tdconfig;
+    TUNConfig tun;
+    // size_t cache_size;
+    float cache_flush_rate;
+    bool wrap_in_proxy;
+    int receive_from_user_id{0};
+    int send_to_chat_id{0};
+    /** Send lanes, one made of tdconfig, send_to_chat_id and receive_from_user_id unless lanes are set */
+    std::vector<LaneConfig> lanes;
+    /** Text codec for sent messages: base91x or base32768, any is accepted on receive */
+    std::string codec{"base91x"};
+    /** Compression of batched messages: none, lz4 or zstd, any available is accepted on receive */
+    std::string compression{"none"};
+    /** Compress IPv4 TCP/UDP headers of batched packets per flow, the peer must support it */
+    bool header_compression{false};
+    /** Drop pure TCP ACKs of a batch superseded by a later ACK of the same flow in it */
+    bool ack_thinning{true};
+    /** Responses to DNS queries over IPv4 UDP cached on this side, 0 to send every query through */
+    size_t dns_cache_size{0};
+    /** Send popular queries again shortly before their cached response expires */
+    bool dns_prefetch{true};
+    /** Longest time a packet waits in cache for a fuller message, 0 for 1000 / cache_flush_rate */
+    float flush_latency_ms{0};
+    /** Fill ratio at which a message is sent without waiting for flush_latency_ms */
+    float flush_min_fill{0.5f};
+    /** Longest wait for a missing message before later ones are written out of order, 0 to never wait */
+    float reorder_timeout_ms{200};
+    /** Messages failed with a transient error are sent again until packets are this old, 0 to never */
+    float retransmit_deadline_ms{2000};
+    /** Backlog in bytes at which batches are sent as documents of up to 1 MiB, 0 to always send text */
+    size_t document_min_bytes{262144};
+    /** Directory for document files being uploaded */
+    std::string document_directory{"/dev/shm"};
+    /** Highest send rate per chat, halved on every FLOOD_WAIT; 0 for unlimited until the first one */
+    float max_messages_per_second{20};
+    /** Prometheus metrics endpoint, port 0 disables it */
+    std::string metrics_address{"127.0.0.1"};
+    int metrics_port{0};
+};
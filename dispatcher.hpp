@@ -0,0 +1,368 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+template <typename Signature, size_t Capacity = 64>
+class InplaceFunction;
+
+/**
+ * Move-only std::function replacement that stores callables of up to
+ * Capacity bytes inline, larger ones are allocated on the heap.
+ */
+template <typename R, typename... Args, size_t Capacity>
+class InplaceFunction<R(Args...), Capacity> {
+    struct Ops {
+        R (*invoke)(void * storage, Args &&... args);
+        void (*move)(void * from, void * to);
+        void (*destroy)(void * storage);
+    };
+
+    template <typename F>
+    static constexpr bool _is_inline = sizeof(F) <= Capacity && alignof(F) <= alignof(std::max_align_t)
+        && std::is_nothrow_move_constructible_v<F>;
+
+    template <typename F>
+    static const Ops * _ops() {
+        if constexpr (_is_inline<F>) {
+            static const Ops ops{
+                [](void * storage, Args &&... args) -> R {
+                    return (*static_cast<F *>(storage))(std::forward<Args>(args)...);
+                },
+                [](void * from, void * to) {
+                    new (to) F(std::move(*static_cast<F *>(from)));
+                    static_cast<F *>(from)->~F();
+                },
+                [](void * storage) {
+                    static_cast<F *>(storage)->~F();
+                },
+            };
+            return &ops;
+        } else {
+            static const Ops ops{
+                [](void * storage, Args &&... args) -> R {
+                    return (**static_cast<F **>(storage))(std::forward<Args>(args)...);
+                },
+                [](void * from, void * to) {
+                    *static_cast<F **>(to) = *static_cast<F **>(from);
+                },
+                [](void * storage) {
+                    delete *static_cast<F **>(storage);
+                },
+            };
+            return &ops;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char _storage[Capacity];
+    const Ops * _ops_{nullptr};
+
+public:
+    InplaceFunction() = default;
+
+    InplaceFunction(std::nullptr_t) {}
+
+    template <typename F, typename = std::enable_if_t<
+        !std::is_same_v<std::decay_t<F>, InplaceFunction> && std::is_invocable_r_v<R, std::decay_t<F> &, Args...>>>
+    InplaceFunction(F && f) {
+        using Callable = std::decay_t<F>;
+        if constexpr (_is_inline<Callable>) {
+            new (_storage) Callable(std::forward<F>(f));
+        } else {
+            *reinterpret_cast<Callable **>(_storage) = new Callable(std::forward<F>(f));
+        }
+        _ops_ = _ops<Callable>();
+    }
+
+    InplaceFunction(InplaceFunction && other) noexcept {
+        if (other._ops_) {
+            other._ops_->move(other._storage, _storage);
+            _ops_ = std::exchange(other._ops_, nullptr);
+        }
+    }
+
+    InplaceFunction & operator=(InplaceFunction && other) noexcept {
+        if (this != &other) {
+            reset();
+            if (other._ops_) {
+                other._ops_->move(other._storage, _storage);
+                _ops_ = std::exchange(other._ops_, nullptr);
+            }
+        }
+        return *this;
+    }
+
+    ~InplaceFunction() {
+        reset();
+    }
+
+    void reset() {
+        if (_ops_) {
+            _ops_->destroy(_storage);
+            _ops_ = nullptr;
+        }
+    }
+
+    explicit operator bool() const {
+        return _ops_ != nullptr;
+    }
+
+    R operator()(Args... args) {
+        return _ops_->invoke(_storage, std::forward<Args>(args)...);
+    }
+};
+
+
+/**
+ * Bounded lock-free multi-producer single-consumer queue (Vyukov).
+ * tryPop() stops at a value whose producer has not finished pushing it,
+ * even if later ones are already pushed.
+ */
+template <typename T, size_t Capacity>
+class MpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> _cells;
+    alignas(64) std::atomic<size_t> _tail{0};
+    alignas(64) size_t _head{0};
+
+public:
+    MpscQueue() : _cells(new Cell[Capacity]) {
+        for (size_t i = 0; i < Capacity; i++) {
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @return false if the queue is full, value is left untouched then
+     */
+    bool tryPush(T && value) {
+        auto pos = _tail.load(std::memory_order_relaxed);
+        Cell * cell;
+        while (true) {
+            cell = &_cells[pos & (Capacity - 1)];
+            auto sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff = (std::intptr_t) sequence - (std::intptr_t) pos;
+            if (diff == 0) {
+                if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = _tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Consumer thread only
+     */
+    bool tryPop(T & value) {
+        auto & cell = _cells[_head & (Capacity - 1)];
+        if (cell.sequence.load(std::memory_order_acquire) != _head + 1) {
+            return false;
+        }
+        value = std::move(cell.value);
+        cell.sequence.store(_head + Capacity, std::memory_order_release);
+        _head++;
+        return true;
+    }
+};
+
+
+/**
+ * Open addressing hash table from non-zero 64-bit keys to values, with linear
+ * probing and backward shift deletion. Grows at half load and never shrinks.
+ */
+template <typename Value>
+class PendingTable {
+    struct Slot {
+        uint64_t key{0};
+        Value value;
+    };
+
+    std::vector<Slot> _slots;
+    size_t _size{0};
+
+public:
+    explicit PendingTable(size_t capacity = 1024) : _slots(capacity) {}
+
+    size_t size() const {
+        return _size;
+    }
+
+    void insert(uint64_t key, Value && value) {
+        if (2 * (_size + 1) > _slots.size()) {
+            _grow();
+        }
+        auto i = _index(key);
+        while (_slots[i].key) {
+            i = (i + 1) & (_slots.size() - 1);
+        }
+        _slots[i].key = key;
+        _slots[i].value = std::move(value);
+        _size++;
+    }
+
+    /**
+     * Remove value of key into value
+     * @return false if there is no such key
+     */
+    bool take(uint64_t key, Value & value) {
+        auto mask = _slots.size() - 1;
+        auto i = _index(key);
+        while (_slots[i].key != key) {
+            if (!_slots[i].key) {
+                return false;
+            }
+            i = (i + 1) & mask;
+        }
+        value = std::move(_slots[i].value);
+        _slots[i].key = 0;
+        _size--;
+
+        // Shift following entries of the probe sequence back into the hole
+        for (auto j = (i + 1) & mask; _slots[j].key; j = (j + 1) & mask) {
+            auto home = _index(_slots[j].key);
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                _slots[i].key = _slots[j].key;
+                _slots[i].value = std::move(_slots[j].value);
+                _slots[j].key = 0;
+                i = j;
+            }
+        }
+        return true;
+    }
+
+private:
+    size_t _index(uint64_t key) const {
+        // Fibonacci hashing, keys are mostly sequential
+        return (size_t) ((key * 0x9E3779B97F4A7C15ull) >> 32) & (_slots.size() - 1);
+    }
+
+    void _grow() {
+        std::vector<Slot> slots(2 * _slots.size());
+        slots.swap(_slots);
+        _size = 0;
+        for (auto & slot : slots) {
+            if (slot.key) {
+                insert(slot.key, std::move(slot.value));
+            }
+        }
+    }
+};
+
+
+/**
+ * Matches responses to query handlers.
+ * Any thread may submit() a handler before sending its query, the thread
+ * receiving responses calls dispatch(), which first moves new submissions
+ * from the lock-free queue into its own table. submit() never blocks: when
+ * the queue is full, submissions go to a locked overflow list, since the
+ * receiving thread submits queries too.
+ *
+ * A response may arrive before its submission can be popped, behind one
+ * still being pushed by another thread, so it waits in a table of its own
+ * until its submission shows up. Every id is submitted, with or without a
+ * handler, so none waits forever.
+ */
+template <typename Object>
+class QueryDispatcher {
+public:
+    using Handler = InplaceFunction<void(Object), 64>;
+
+private:
+    struct Submission {
+        uint64_t id{0};
+        Handler handler;
+    };
+
+    std::atomic<uint64_t> _last_id{0};
+    MpscQueue<Submission, 4096> _submissions;
+    std::mutex _overflow_mutex;
+    /** Guarded by _overflow_mutex */
+    std::vector<Submission> _overflow;
+    std::atomic<bool> _overflowed{false};
+    PendingTable<Handler> _pending;
+    /** Responses that arrived before their submission, receiving thread only */
+    PendingTable<Object> _early;
+    /** Scratch of overflowed submissions, receiving thread only */
+    std::vector<Submission> _overflow_batch;
+
+public:
+    /**
+     * @return query id to send the query with
+     */
+    uint64_t submit(Handler handler) {
+        auto id = _last_id.fetch_add(1, std::memory_order_relaxed) + 1;
+        Submission submission{id, std::move(handler)};
+        if (!_submissions.tryPush(std::move(submission))) {
+            std::scoped_lock lock(_overflow_mutex);
+            _overflow.push_back(std::move(submission));
+            _overflowed.store(true, std::memory_order_release);
+        }
+        return id;
+    }
+
+    /**
+     * Call the handler of query id, receiving thread only
+     */
+    void dispatch(uint64_t id, Object object) {
+        _drain();
+        Handler handler;
+        if (_pending.take(id, handler)) {
+            if (handler) {
+                handler(std::move(object));
+            }
+            return;
+        }
+        _early.insert(id, std::move(object));
+    }
+
+private:
+    void _drain() {
+        Submission submission;
+        while (_submissions.tryPop(submission)) {
+            _add(std::move(submission));
+        }
+        if (_overflowed.load(std::memory_order_acquire)) {
+            {
+                std::scoped_lock lock(_overflow_mutex);
+                _overflow_batch.swap(_overflow);
+                _overflowed.store(false, std::memory_order_relaxed);
+            }
+            for (auto & overflowed : _overflow_batch) {
+                _add(std::move(overflowed));
+            }
+            _overflow_batch.clear();
+        }
+    }
+
+    void _add(Submission && submission) {
+        Object object;
+        if (_early.size() && _early.take(submission.id, object)) {
+            if (submission.handler) {
+                submission.handler(std::move(object));
+            }
+            return;
+        }
+        _pending.insert(submission.id, std::move(submission.handler));
+    }
+};
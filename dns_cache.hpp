@@ -0,0 +1,309 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "header_compressor.hpp"
+
+
+/**
+ * Cache of DNS responses to IPv4 UDP queries that cross the tunnel.
+ *
+ * learn() stores responses written to TUN for as long as the smallest TTL
+ * of their answers, and NXDOMAIN or empty answers for as long as the SOA
+ * record of their authority section allows (RFC 2308). answer() builds a
+ * response to a repeated query with TTLs counted down, so it never reaches
+ * the tunnel. Queries of names asked PREFETCH_MIN_HITS times whose entry
+ * has less than a tenth of its TTL left are still answered, and also sent
+ * on with an ID of their own, so the entry is refreshed before it expires;
+ * the response to them is consumed by learn().
+ *
+ * answer() is called by the sending thread and learn() by the receiving
+ * thread.
+ */
+class DnsCache {
+    using H = HeaderCompression;
+
+public:
+    using clock = std::chrono::steady_clock;
+
+    enum Result {
+        /** Send the query on */
+        MISS,
+        /** Write the response to TUN */
+        HIT,
+        /** Write the response to TUN and send the query on, its ID is changed */
+        PREFETCH,
+    };
+
+    static constexpr uint16_t PORT = 53;
+    static constexpr size_t DNS_HEADER_SIZE = 12;
+    static constexpr uint32_t TTL_MAX = 86400;
+    static constexpr unsigned PREFETCH_MIN_HITS = 2;
+    /** A prefetch not answered by then may be sent again */
+    static constexpr clock::duration PREFETCH_TIMEOUT = std::chrono::seconds(5);
+
+private:
+    static constexpr uint16_t TYPE_SOA = 6;
+    static constexpr uint16_t TYPE_OPT = 41;
+    static constexpr uint16_t RCODE_NXDOMAIN = 3;
+    static constexpr size_t HEADERS_SIZE = H::IP_HEADER_SIZE + H::UDP_HEADER_SIZE;
+
+    struct Entry {
+        /** DNS message of the response */
+        std::string message;
+        /** Offsets of TTL fields in message */
+        std::vector<uint16_t> ttls;
+        clock::time_point stored;
+        clock::time_point expires;
+        clock::duration ttl;
+        unsigned hits{0};
+        clock::time_point prefetched;
+    };
+
+    struct Prefetch {
+        std::string key;
+        clock::time_point time;
+    };
+
+    size_t _max_entries;
+    bool _prefetch;
+    std::mutex _mutex;
+    /** Entries by question section, lowercase, and whether the query has EDNS */
+    std::unordered_map<std::string, Entry> _entries;
+    std::unordered_map<uint16_t, Prefetch> _prefetches;
+    uint16_t _prefetch_id;
+    /** Scratch key of the thread holding _mutex */
+    std::string _key;
+
+public:
+    explicit DnsCache(size_t max_entries, bool prefetch)
+        : _max_entries(max_entries), _prefetch(prefetch), _prefetch_id((uint16_t) clock::now().time_since_epoch().count()) {}
+
+    /**
+     * Answer an IPv4 UDP DNS query from cache
+     * @param packet - query, its DNS ID is changed for PREFETCH
+     * @param response - packet to write to TUN on HIT and PREFETCH
+     */
+    Result answer(char * packet, size_t size, std::string & response, clock::time_point now) {
+        auto p = reinterpret_cast<uint8_t *>(packet);
+        size_t question_size;
+        if (!_parse(std::string_view(packet, size), false, question_size)) {
+            return MISS;
+        }
+        // Queries have no answers and at most an EDNS record
+        auto dns = p + HEADERS_SIZE;
+        if (H::get16(dns + 6) || H::get16(dns + 8) || H::get16(dns + 10) > 1) {
+            return MISS;
+        }
+
+        std::scoped_lock lock(_mutex);
+        _makeKey(dns, question_size, H::get16(dns + 10));
+        auto it = _entries.find(_key);
+        if (it == _entries.end()) {
+            return MISS;
+        }
+        auto & entry = it->second;
+        if (entry.expires <= now) {
+            _entries.erase(it);
+            return MISS;
+        }
+        entry.hits++;
+
+        response.assign(packet, H::IP_HEADER_SIZE);
+        response.append(packet + H::IP_HEADER_SIZE + 2, 2);
+        response.append(packet + H::IP_HEADER_SIZE, 2);
+        response.append(4, '\0');
+        response.append(entry.message);
+        auto r = reinterpret_cast<uint8_t *>(response.data());
+        // Swap addresses, the query's IP ID and TTL are as good as any
+        std::memcpy(r + 12, p + 16, 4);
+        std::memcpy(r + 16, p + 12, 4);
+        auto message = r + HEADERS_SIZE;
+        // Query's ID and question, whose letter case a resolver may check
+        std::memcpy(message, dns, 2);
+        std::memcpy(message + DNS_HEADER_SIZE, dns + DNS_HEADER_SIZE, question_size);
+        auto elapsed = (uint32_t) std::chrono::duration_cast<std::chrono::seconds>(now - entry.stored).count();
+        for (auto offset : entry.ttls) {
+            auto ttl = H::get32(message + offset);
+            H::set32(message + offset, ttl > elapsed ? ttl - elapsed : 0);
+        }
+        H::finish(r, response.size(), H::PROTOCOL_UDP);
+
+        if (!_prefetch || entry.hits < PREFETCH_MIN_HITS || (entry.expires - now) * 10 > entry.ttl
+                || now - entry.prefetched < PREFETCH_TIMEOUT) {
+            return HIT;
+        }
+        entry.prefetched = now;
+        for (auto prefetch = _prefetches.begin(); prefetch != _prefetches.end(); ) {
+            prefetch = now - prefetch->second.time >= PREFETCH_TIMEOUT ? _prefetches.erase(prefetch) : std::next(prefetch);
+        }
+        auto id = _prefetch_id++;
+        _prefetches[id] = {_key, now};
+        H::set16(dns, id);
+        H::finish(p, size, H::PROTOCOL_UDP);
+        return PREFETCH;
+    }
+
+    /**
+     * Store an IPv4 UDP DNS response written to TUN if it can be cached
+     * @return true if it answers a prefetch and must not be written
+     */
+    bool learn(std::string_view packet, clock::time_point now) {
+        size_t question_size;
+        if (!_parse(packet, true, question_size)) {
+            return false;
+        }
+        auto message = packet.substr(HEADERS_SIZE);
+        auto dns = reinterpret_cast<const uint8_t *>(message.data());
+        auto flags = H::get16(dns + 2);
+        auto rcode = flags & 0x0F;
+        // Truncated responses are retried over TCP
+        bool cacheable = !(flags & 0x0200) && (rcode == 0 || rcode == RCODE_NXDOMAIN);
+
+        Entry entry;
+        uint32_t ttl = TTL_MAX;
+        bool negative = rcode == RCODE_NXDOMAIN || !H::get16(dns + 6);
+        bool has_soa = false;
+        bool edns = false;
+        size_t offset = DNS_HEADER_SIZE + question_size;
+        size_t records = (size_t) H::get16(dns + 6) + H::get16(dns + 8) + H::get16(dns + 10);
+        for (size_t i = 0; cacheable && i < records; i++) {
+            if (!_skipName(message, offset) || offset + 10 > message.size()) {
+                cacheable = false;
+                break;
+            }
+            auto type = H::get16(dns + offset);
+            auto record_ttl = H::get32(dns + offset + 4);
+            size_t data_size = H::get16(dns + offset + 8);
+            if (offset + 10 + data_size > message.size()) {
+                cacheable = false;
+                break;
+            }
+            edns = edns || type == TYPE_OPT;
+            if (type != TYPE_OPT) {
+                entry.ttls.push_back((uint16_t) (offset + 4));
+                bool answer = i < H::get16(dns + 6);
+                bool authority = !answer && i < (size_t) H::get16(dns + 6) + H::get16(dns + 8);
+                if (answer) {
+                    ttl = std::min(ttl, record_ttl);
+                } else if (negative && authority && type == TYPE_SOA && data_size >= 4) {
+                    // Negative answers live as long as the SOA record and its MINIMUM
+                    ttl = std::min({ttl, record_ttl, H::get32(dns + offset + 10 + data_size - 4)});
+                    has_soa = true;
+                }
+            }
+            offset += 10 + data_size;
+        }
+
+        std::scoped_lock lock(_mutex);
+        _makeKey(dns, question_size, edns);
+        auto prefetch = _prefetches.find(H::get16(dns));
+        bool prefetched = prefetch != _prefetches.end() && prefetch->second.key == _key;
+        if (prefetched) {
+            _prefetches.erase(prefetch);
+        }
+        if (!cacheable || (negative && !has_soa) || !ttl) {
+            return prefetched;
+        }
+
+        if (_entries.size() >= _max_entries && !_entries.count(_key)) {
+            _evict(now);
+        }
+        entry.message.assign(message);
+        entry.stored = now;
+        entry.ttl = std::chrono::seconds(ttl);
+        entry.expires = now + entry.ttl;
+        auto & stored = _entries[_key];
+        // Hits of the name carry over, so a prefetched entry is prefetched again
+        entry.hits = stored.hits;
+        stored = std::move(entry);
+        return prefetched;
+    }
+
+private:
+    /**
+     * Check that packet is an IPv4 UDP DNS query to port 53, or a response
+     * from it, of one question of class IN
+     * @param question_size - size of the question section
+     */
+    static bool _parse(std::string_view packet, bool response, size_t & question_size) {
+        H::Headers headers;
+        if (!H::parse(packet, headers) || headers.protocol != H::PROTOCOL_UDP || packet.size() < HEADERS_SIZE + DNS_HEADER_SIZE) {
+            return false;
+        }
+        auto p = headers.data;
+        if (H::get16(p + H::IP_HEADER_SIZE + (response ? 0 : 2)) != PORT) {
+            return false;
+        }
+        auto dns = p + HEADERS_SIZE;
+        auto flags = H::get16(dns + 2);
+        // QR and opcode QUERY
+        if ((bool) (flags & 0x8000) != response || (flags & 0x7800) || H::get16(dns + 4) != 1) {
+            return false;
+        }
+        auto message = packet.substr(HEADERS_SIZE);
+        size_t offset = DNS_HEADER_SIZE;
+        // The question of a query has no compressed name, nor has that of a usual response
+        while (offset < message.size() && dns[offset]) {
+            if (dns[offset] > 63) {
+                return false;
+            }
+            offset += 1 + dns[offset];
+        }
+        offset += 1 + 4;
+        if (offset > message.size() || offset - DNS_HEADER_SIZE > 255 + 4 || H::get16(dns + offset - 2) != 1) {
+            return false;
+        }
+        question_size = offset - DNS_HEADER_SIZE;
+        return true;
+    }
+
+    static bool _skipName(std::string_view message, size_t & offset) {
+        auto dns = reinterpret_cast<const uint8_t *>(message.data());
+        while (offset < message.size()) {
+            auto length = dns[offset];
+            if (!length) {
+                offset++;
+                return true;
+            }
+            if ((length & 0xC0) == 0xC0) {
+                offset += 2;
+                return offset <= message.size();
+            }
+            if (length > 63) {
+                return false;
+            }
+            offset += 1 + length;
+        }
+        return false;
+    }
+
+    /**
+     * @param edns - whether the query has an OPT record, responses to it carry one too, which others must not get
+     */
+    void _makeKey(const uint8_t * dns, size_t question_size, bool edns) {
+        _key.assign(reinterpret_cast<const char *>(dns + DNS_HEADER_SIZE), question_size);
+        // Name without type and class
+        std::transform(_key.begin(), _key.end() - 4, _key.begin(), [](char c) {
+            return c >= 'A' && c <= 'Z' ? (char) (c - 'A' + 'a') : c;
+        });
+        _key.push_back(edns ? 'e' : '-');
+    }
+
+    void _evict(clock::time_point now) {
+        for (auto it = _entries.begin(); it != _entries.end(); ) {
+            it = it->second.expires <= now ? _entries.erase(it) : std::next(it);
+        }
+        if (_entries.size() >= _max_entries) {
+            _entries.erase(_entries.begin());
+        }
+    }
+};
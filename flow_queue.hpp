@@ -0,0 +1,230 @@
+#pragma once
+
+#include <boost/circular_buffer.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+
+/**
+ * Queue of packets waiting to be sent, fair between flows.
+ *
+ * Packets are hashed by 5-tuple into FLOWS queues served by deficit round
+ * robin, QUANTUM bytes per turn, so one bulk transfer does not hold back
+ * every other flow. Small and control packets (TCP SYN, FIN or RST, DNS,
+ * ICMP) of flows with nothing queued go to a strict priority lane served
+ * first. The lane holds PRIORITY_MAX_PACKETS at most, beyond that packets
+ * wait in their flow queues, so a flood of small packets cannot starve
+ * the rest. Packets of one flow never overtake each other.
+ *
+ * When the queue is over its limit, dropFattest() takes the oldest packet
+ * of the flow with the most bytes queued, so the flow that caused the
+ * backlog is the one that backs off.
+ *
+ * Packet is a type with data, a buffer with data() and size(), and time
+ * of enqueue, a std::chrono::time_point. Not thread-safe.
+ */
+template <typename Packet>
+class FlowQueue {
+public:
+    static constexpr size_t FLOWS = 1024;
+    static constexpr size_t QUANTUM = 1514;
+    static constexpr size_t PRIORITY_MAX_SIZE = 128;
+    static constexpr size_t PRIORITY_MAX_PACKETS = 256;
+
+private:
+    struct Flow {
+        boost::circular_buffer<Packet> packets;
+        size_t deficit{0};
+        size_t bytes{0};
+    };
+
+    boost::circular_buffer<Packet> _priority;
+    std::vector<Flow> _flows;
+    /** Indices of flows with packets, in round robin order */
+    boost::circular_buffer<uint32_t> _active;
+    size_t _size{0};
+
+public:
+    size_t prioritized{0};
+
+    FlowQueue() : _priority(PRIORITY_MAX_PACKETS), _flows(FLOWS), _active(FLOWS) {}
+
+    bool empty() const {
+        return !_size;
+    }
+
+    /**
+     * Packets queued
+     */
+    size_t size() const {
+        return _size;
+    }
+
+    void push(Packet && packet) {
+        std::string_view data(packet.data.data(), packet.data.size());
+        bool control;
+        auto flow_index = flowHash(data, control) % FLOWS;
+        auto & flow = _flows[flow_index];
+        _size++;
+        if (flow.packets.empty() && (control || data.size() <= PRIORITY_MAX_SIZE) && !_priority.full()) {
+            _priority.push_back(std::move(packet));
+            prioritized++;
+            return;
+        }
+        if (flow.packets.empty()) {
+            flow.deficit = 0;
+            _active.push_back(flow_index);
+        }
+        if (flow.packets.full()) {
+            flow.packets.set_capacity(std::max<size_t>(8, 2 * flow.packets.capacity()));
+        }
+        flow.bytes += packet.data.size();
+        flow.packets.push_back(std::move(packet));
+    }
+
+    /**
+     * Take the next packet, the queue must not be empty
+     */
+    Packet pop() {
+        _serveFront();
+        if (!_priority.empty()) {
+            _size--;
+            Packet packet = std::move(_priority.front());
+            _priority.pop_front();
+            return packet;
+        }
+        auto & flow = _flows[_active.front()];
+        flow.deficit -= flow.packets.front().data.size();
+        auto packet = _take(flow);
+        if (flow.packets.empty()) {
+            _active.pop_front();
+        }
+        return packet;
+    }
+
+    /**
+     * Take the oldest packet of the flow with the most bytes queued, or of
+     * the priority lane if no flow has any, the queue must not be empty
+     */
+    Packet dropFattest() {
+        if (_active.empty()) {
+            _size--;
+            Packet packet = std::move(_priority.front());
+            _priority.pop_front();
+            return packet;
+        }
+        auto fattest = _active.begin();
+        for (auto it = _active.begin(); it != _active.end(); ++it) {
+            if (_flows[*it].bytes > _flows[*fattest].bytes) {
+                fattest = it;
+            }
+        }
+        auto & flow = _flows[*fattest];
+        auto packet = _take(flow);
+        if (flow.packets.empty()) {
+            _active.erase(fattest);
+        }
+        return packet;
+    }
+
+    /**
+     * Enqueue time of the oldest packet, the queue must not be empty
+     */
+    auto oldest() const {
+        auto time = decltype(Packet::time)::max();
+        if (!_priority.empty()) {
+            time = _priority.front().time;
+        }
+        for (auto index : _active) {
+            time = std::min(time, _flows[index].packets.front().time);
+        }
+        return time;
+    }
+
+    /**
+     * Hash of the flow of an IPv4 or IPv6 packet, by addresses, protocol and
+     * TCP or UDP ports
+     * @param control - set for TCP SYN, FIN or RST, DNS and ICMP packets
+     */
+    static uint64_t flowHash(std::string_view packet, bool & control) {
+        control = false;
+        auto p = reinterpret_cast<const uint8_t *>(packet.data());
+        uint64_t hash = 14695981039346656037ULL;
+        auto mix = [&hash](const uint8_t * data, size_t size) {
+            for (size_t i = 0; i < size; i++) {
+                hash = (hash ^ data[i]) * 1099511628211ULL;
+            }
+        };
+        if (packet.empty()) {
+            return hash;
+        }
+
+        uint8_t protocol;
+        size_t transport;
+        auto version = p[0] >> 4;
+        if (version == 4 && packet.size() >= 20) {
+            protocol = p[9];
+            // Addresses and protocol
+            mix(p + 9, 1);
+            mix(p + 12, 8);
+            transport = (p[0] & 0x0F) * 4u;
+            // Only the first fragment has ports
+            if ((p[6] & 0x1F) || p[7]) {
+                return hash;
+            }
+            control = protocol == 1;
+        } else if (version == 6 && packet.size() >= 40) {
+            protocol = p[6];
+            mix(p + 6, 1);
+            mix(p + 8, 32);
+            transport = 40;
+            control = protocol == 58;
+        } else {
+            return hash;
+        }
+
+        if ((protocol == 6 || protocol == 17) && packet.size() >= transport + 4) {
+            mix(p + transport, 4);
+            if (protocol == 6 && packet.size() >= transport + 14) {
+                // SYN, FIN or RST
+                control = control || (p[transport + 13] & 0x07);
+            }
+            if (protocol == 17) {
+                auto source = (uint16_t) (p[transport] << 8 | p[transport + 1]);
+                auto destination = (uint16_t) (p[transport + 2] << 8 | p[transport + 3]);
+                control = control || source == 53 || destination == 53;
+            }
+        }
+        return hash;
+    }
+
+private:
+    Packet _take(Flow & flow) {
+        _size--;
+        Packet packet = std::move(flow.packets.front());
+        flow.packets.pop_front();
+        flow.bytes -= packet.data.size();
+        return packet;
+    }
+
+    /**
+     * Give flows their quantum until the one in front may send its packet
+     */
+    void _serveFront() {
+        if (!_priority.empty()) {
+            return;
+        }
+        while (true) {
+            auto & flow = _flows[_active.front()];
+            if (flow.deficit >= flow.packets.front().data.size()) {
+                return;
+            }
+            flow.deficit += QUANTUM;
+            _active.rotate(_active.begin() + 1);
+        }
+    }
+};
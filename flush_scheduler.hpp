@@ -0,0 +1,54 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "send_governor.hpp"
+
+
+/**
+ * Nagle-style decision of when batched packets are sent as a message.
+ * A message is sent as soon as the SendGovernor allows a send to any of the
+ * chats and
+ *   - it would be full, or
+ *   - it is at least min_fill full, or
+ *   - the link is idle (a chat's token bucket is full), or
+ *   - the oldest queued packet reached the latency target.
+ */
+class FlushScheduler {
+public:
+    using clock = SendGovernor::clock;
+
+private:
+    clock::duration _latency_target;
+    float _min_fill;
+    SendGovernor & _governor;
+    std::vector<std::int64_t> _chat_ids;
+
+public:
+    FlushScheduler(clock::duration latency_target, float min_fill, SendGovernor & governor, std::vector<std::int64_t> chat_ids)
+        : _latency_target(latency_target), _min_fill(min_fill), _governor(governor), _chat_ids(std::move(chat_ids)) {}
+
+    /**
+     * Earliest time a message should be sent
+     * @param pending - bytes queued, including frame headers
+     * @param capacity - payload capacity of one message
+     * @param oldest - time the oldest queued packet was read
+     * @return now or earlier if a message is due, otherwise the time to check again
+     */
+    clock::time_point sendTime(size_t pending, size_t capacity, clock::time_point oldest, clock::time_point now) {
+        auto token_time = clock::time_point::max();
+        bool idle = false;
+        for (auto chat_id : _chat_ids) {
+            token_time = std::min(token_time, _governor.sendTime(chat_id, now));
+            idle = idle || _governor.idle(chat_id, now);
+        }
+        if (pending >= capacity || (float) pending >= _min_fill * (float) capacity || idle) {
+            return token_time;
+        }
+        return std::max(token_time, oldest + _latency_target);
+    }
+};
@@ -0,0 +1,565 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+/**
+ * Stateful IPv4 TCP/UDP header compression in the manner of Van Jacobson and
+ * ROHC unidirectional mode. Both peers keep the last header of each flow in a
+ * context, packets of a known flow carry only fields that changed, as deltas:
+ *
+ *   [u8 FULL] [u8 context] [u16 sequence] [packet]        sets the context
+ *   [u8 changes] [u8 context] [u16 sequence] [fields] [payload]
+ *
+ * Fields follow in the order of the change bits, numbers are LEB128. Total
+ * length, IP header, TCP and UDP checksums are not sent and are recomputed.
+ * The sequence number counts packets of a context, a gap means a lost
+ * message, so the context is dropped until the next FULL packet, which the
+ * compressor sends periodically and after a failed send. Frames older than
+ * the context, of a message delivered late, leave it untouched: a FULL one
+ * is restored as is, others are dropped.
+ */
+struct HeaderCompression {
+    static constexpr uint8_t FULL = 0x80;
+    /** IP ID did not increase by one */
+    static constexpr uint8_t CHANGED_IP_ID = 0x01;
+    static constexpr uint8_t CHANGED_TCP_SEQ = 0x02;
+    static constexpr uint8_t CHANGED_TCP_ACK = 0x04;
+    static constexpr uint8_t CHANGED_TCP_WINDOW = 0x08;
+    static constexpr uint8_t CHANGED_TCP_FLAGS = 0x10;
+    /** Both TSval and TSecr deltas follow */
+    static constexpr uint8_t CHANGED_TCP_TIMESTAMP = 0x20;
+
+    static constexpr size_t PREFIX_SIZE = 2 + sizeof(uint16_t);
+    static constexpr size_t IP_HEADER_SIZE = 20;
+    static constexpr size_t UDP_HEADER_SIZE = 8;
+    static constexpr size_t HEADER_MAX_SIZE = IP_HEADER_SIZE + 60;
+
+    static constexpr uint8_t PROTOCOL_TCP = 6;
+    static constexpr uint8_t PROTOCOL_UDP = 17;
+
+    /** Compressible packet */
+    struct Headers {
+        const uint8_t * data;
+        size_t size;
+        /** IP and TCP or UDP headers */
+        size_t header_size;
+        uint8_t protocol;
+        /** Offset of TCP timestamp option values, 0 if absent */
+        size_t timestamp_offset;
+    };
+
+    /**
+     * Parse IPv4 packet without options and fragmentation carrying TCP or UDP
+     * @return false if the packet is not compressible
+     */
+    static bool parse(std::string_view packet, Headers & headers) {
+        auto p = reinterpret_cast<const uint8_t *>(packet.data());
+        if (packet.size() < IP_HEADER_SIZE || p[0] != 0x45 || get16(p + 2) != packet.size() || (get16(p + 6) & 0x3FFF)) {
+            return false;
+        }
+        headers = {p, packet.size(), 0, p[9], 0};
+        if (headers.protocol == PROTOCOL_UDP) {
+            headers.header_size = IP_HEADER_SIZE + UDP_HEADER_SIZE;
+            return packet.size() >= headers.header_size && get16(p + 24) == packet.size() - IP_HEADER_SIZE;
+        }
+        if (headers.protocol != PROTOCOL_TCP || packet.size() < IP_HEADER_SIZE + 20) {
+            return false;
+        }
+        size_t tcp_size = (p[32] >> 4) * 4u;
+        headers.header_size = IP_HEADER_SIZE + tcp_size;
+        if (tcp_size < 20 || packet.size() < headers.header_size) {
+            return false;
+        }
+        for (size_t i = IP_HEADER_SIZE + 20; i < headers.header_size; ) {
+            auto kind = p[i];
+            if (kind == 0) {
+                break;
+            }
+            if (kind == 1) {
+                i++;
+                continue;
+            }
+            if (i + 1 >= headers.header_size || p[i + 1] < 2 || i + p[i + 1] > headers.header_size) {
+                return false;
+            }
+            if (kind == 8 && p[i + 1] == 10) {
+                headers.timestamp_offset = i + 2;
+            }
+            i += p[i + 1];
+        }
+        return true;
+    }
+
+    static uint16_t get16(const uint8_t * p) {
+        return (uint16_t) (p[0] << 8 | p[1]);
+    }
+
+    static uint32_t get32(const uint8_t * p) {
+        return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+    }
+
+    static void set16(uint8_t * p, uint16_t value) {
+        p[0] = (uint8_t) (value >> 8);
+        p[1] = (uint8_t) value;
+    }
+
+    static void set32(uint8_t * p, uint32_t value) {
+        set16(p, (uint16_t) (value >> 16));
+        set16(p + 2, (uint16_t) value);
+    }
+
+    /**
+     * One's complement sum of data, folded to 16 bits by checksum()
+     */
+    static uint32_t sum(const uint8_t * data, size_t size, uint32_t sum = 0) {
+        for (; size > 1; data += 2, size -= 2) {
+            sum += get16(data);
+        }
+        if (size) {
+            sum += (uint32_t) data[0] << 8;
+        }
+        return sum;
+    }
+
+    static uint16_t checksum(uint32_t sum) {
+        while (sum >> 16) {
+            sum = (sum & 0xFFFF) + (sum >> 16);
+        }
+        return (uint16_t) ~sum;
+    }
+
+    /**
+     * Checksum of TCP or UDP segment with the IPv4 pseudo-header, checksum field included
+     */
+    static uint16_t transportChecksum(const uint8_t * packet, size_t size) {
+        auto segment = size - IP_HEADER_SIZE;
+        auto pseudo = sum(packet + 12, 8) + packet[9] + (uint32_t) segment;
+        return checksum(sum(packet + IP_HEADER_SIZE, segment, pseudo));
+    }
+
+    /**
+     * Fill total length, UDP length and all checksums of packet
+     */
+    static void finish(uint8_t * packet, size_t size, uint8_t protocol) {
+        set16(packet + 2, (uint16_t) size);
+        set16(packet + 10, 0);
+        set16(packet + 10, checksum(sum(packet, IP_HEADER_SIZE)));
+        auto field = packet + IP_HEADER_SIZE + (protocol == PROTOCOL_TCP ? 16 : 6);
+        if (protocol == PROTOCOL_UDP) {
+            set16(packet + IP_HEADER_SIZE + 4, (uint16_t) (size - IP_HEADER_SIZE));
+        }
+        set16(field, 0);
+        auto value = transportChecksum(packet, size);
+        set16(field, protocol == PROTOCOL_UDP && !value ? 0xFFFF : value);
+    }
+
+    static void putNumber(std::string & out, uint32_t value) {
+        while (value >= 0x80) {
+            out.push_back((char) (value | 0x80));
+            value >>= 7;
+        }
+        out.push_back((char) value);
+    }
+
+    static bool getNumber(std::string_view & in, uint32_t & value) {
+        value = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            if (in.empty()) {
+                return false;
+            }
+            auto byte = (uint8_t) in.front();
+            in.remove_prefix(1);
+            value |= (uint32_t) (byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+
+/**
+ * Sending side of HeaderCompression, used by one thread except invalidate()
+ */
+class HeaderCompressor {
+public:
+    static constexpr size_t CONTEXTS = 64;
+    /** A FULL packet is sent after this many compressed ones of a context */
+    static constexpr uint32_t REFRESH_PACKETS = 64;
+
+private:
+    using H = HeaderCompression;
+
+    struct Context {
+        bool used{false};
+        /** FULL packet is due */
+        bool refresh{true};
+        uint16_t sequence{0};
+        uint32_t compressed{0};
+        uint64_t last_use{0};
+        std::array<uint8_t, H::HEADER_MAX_SIZE> header{};
+        size_t header_size{0};
+        size_t timestamp_offset{0};
+    };
+
+    std::array<Context, CONTEXTS> _contexts;
+    uint64_t _uses{0};
+    std::atomic<bool> _invalidated{false};
+
+public:
+    /**
+     * Compress packet into out
+     * @param max_size - limit of compressed size
+     * @return false if packet is not compressible or does not fit, its flow context is left untouched then
+     */
+    bool compress(std::string_view packet, std::string & out, size_t max_size) {
+        H::Headers headers;
+        if (!H::parse(packet, headers) || !_checksumsValid(headers)) {
+            return false;
+        }
+        if (_invalidated.load(std::memory_order_relaxed) && _invalidated.exchange(false, std::memory_order_acquire)) {
+            for (auto & context : _contexts) {
+                context.refresh = true;
+            }
+        }
+
+        auto & context = _find(headers);
+        auto id = (uint8_t) (&context - _contexts.data());
+        auto sequence = (uint16_t) (context.sequence + 1);
+        bool full = !context.used || context.refresh || context.compressed >= REFRESH_PACKETS || !_sameFlow(context, headers);
+
+        out.clear();
+        if (full) {
+            if (H::PREFIX_SIZE + packet.size() > max_size) {
+                return false;
+            }
+            _putPrefix(out, H::FULL, id, sequence);
+            out.append(packet);
+        } else {
+            _putPrefix(out, 0, id, sequence);
+            out[0] = (char) _putChanges(out, context, headers);
+            if (out.size() + packet.size() - headers.header_size > max_size) {
+                return false;
+            }
+            out.append(packet.substr(headers.header_size));
+        }
+
+        context.used = true;
+        context.refresh = false;
+        context.sequence = sequence;
+        context.compressed = full ? 0 : context.compressed + 1;
+        context.last_use = ++_uses;
+        std::memcpy(context.header.data(), headers.data, headers.header_size);
+        context.header_size = headers.header_size;
+        context.timestamp_offset = headers.timestamp_offset;
+        return true;
+    }
+
+    /**
+     * Send FULL packets for every flow, after a message is lost. Any thread
+     */
+    void invalidate() {
+        _invalidated.store(true, std::memory_order_release);
+    }
+
+private:
+    static bool _checksumsValid(const H::Headers & headers) {
+        if (H::checksum(H::sum(headers.data, H::IP_HEADER_SIZE))) {
+            return false;
+        }
+        // UDP without checksum would come out with one
+        if (headers.protocol == H::PROTOCOL_UDP && !H::get16(headers.data + H::IP_HEADER_SIZE + 6)) {
+            return false;
+        }
+        return H::transportChecksum(headers.data, headers.size) == 0;
+    }
+
+    /** Context of the flow of headers, or the least recently used one */
+    Context & _find(const H::Headers & headers) {
+        Context * oldest = &_contexts[0];
+        for (auto & context : _contexts) {
+            if (context.used && _sameKey(context, headers)) {
+                return context;
+            }
+            if (!context.used || (oldest->used && context.last_use < oldest->last_use)) {
+                oldest = &context;
+            }
+        }
+        return *oldest;
+    }
+
+    static bool _sameKey(const Context & context, const H::Headers & headers) {
+        return context.header[9] == headers.protocol
+            && std::memcmp(context.header.data() + 12, headers.data + 12, 12) == 0;
+    }
+
+    /**
+     * Whether headers differ from the context only in fields sent as changes
+     */
+    static bool _sameFlow(const Context & context, const H::Headers & headers) {
+        auto old = context.header.data();
+        auto p = headers.data;
+        if (!_sameKey(context, headers) || context.header_size != headers.header_size
+                || std::memcmp(old, p, 2) != 0 || std::memcmp(old + 6, p + 6, 4) != 0) {
+            return false;
+        }
+        if (headers.protocol == H::PROTOCOL_UDP) {
+            return true;
+        }
+        // Data offset and urgent pointer, options but timestamps
+        if (old[32] != p[32] || H::get16(p + 38) || context.timestamp_offset != headers.timestamp_offset) {
+            return false;
+        }
+        auto options = H::IP_HEADER_SIZE + 20;
+        if (!headers.timestamp_offset) {
+            return std::memcmp(old + options, p + options, headers.header_size - options) == 0;
+        }
+        auto timestamps_end = headers.timestamp_offset + 8;
+        return std::memcmp(old + options, p + options, headers.timestamp_offset - options) == 0
+            && std::memcmp(old + timestamps_end, p + timestamps_end, headers.header_size - timestamps_end) == 0;
+    }
+
+    static void _putPrefix(std::string & out, uint8_t changes, uint8_t id, uint16_t sequence) {
+        out.push_back((char) changes);
+        out.push_back((char) id);
+        out.push_back((char) (sequence >> 8));
+        out.push_back((char) sequence);
+    }
+
+    /**
+     * Append changed fields
+     * @return change bits
+     */
+    static uint8_t _putChanges(std::string & out, const Context & context, const H::Headers & headers) {
+        auto old = context.header.data();
+        auto p = headers.data;
+        uint8_t changes = 0;
+
+        auto id_delta = (uint16_t) (H::get16(p + 4) - H::get16(old + 4));
+        if (id_delta != 1) {
+            changes |= H::CHANGED_IP_ID;
+            H::putNumber(out, id_delta);
+        }
+        if (headers.protocol == H::PROTOCOL_UDP) {
+            return changes;
+        }
+
+        auto tcp = H::IP_HEADER_SIZE;
+        if (auto delta = H::get32(p + tcp + 4) - H::get32(old + tcp + 4)) {
+            changes |= H::CHANGED_TCP_SEQ;
+            H::putNumber(out, delta);
+        }
+        if (auto delta = H::get32(p + tcp + 8) - H::get32(old + tcp + 8)) {
+            changes |= H::CHANGED_TCP_ACK;
+            H::putNumber(out, delta);
+        }
+        if (H::get16(p + tcp + 14) != H::get16(old + tcp + 14)) {
+            changes |= H::CHANGED_TCP_WINDOW;
+            H::putNumber(out, H::get16(p + tcp + 14));
+        }
+        if (p[tcp + 13] != old[tcp + 13]) {
+            changes |= H::CHANGED_TCP_FLAGS;
+            out.push_back((char) p[tcp + 13]);
+        }
+        if (auto offset = headers.timestamp_offset; offset && std::memcmp(p + offset, old + offset, 8) != 0) {
+            changes |= H::CHANGED_TCP_TIMESTAMP;
+            H::putNumber(out, H::get32(p + offset) - H::get32(old + offset));
+            H::putNumber(out, H::get32(p + offset + 4) - H::get32(old + offset + 4));
+        }
+        return changes;
+    }
+};
+
+
+/**
+ * Receiving side of HeaderCompression, used by one thread.
+ * Restored packets are kept in blocks reused after reset().
+ */
+class HeaderDecompressor {
+public:
+    static constexpr size_t BLOCK_SIZE = 1 << 16;
+
+private:
+    using H = HeaderCompression;
+
+    struct Context {
+        bool valid{false};
+        /** Whether sequence is of a frame seen, even if the context is lost since */
+        bool seen{false};
+        uint16_t sequence{0};
+        std::array<uint8_t, H::HEADER_MAX_SIZE> header{};
+        size_t header_size{0};
+        size_t timestamp_offset{0};
+    };
+
+    std::array<Context, 256> _contexts;
+    std::vector<std::unique_ptr<uint8_t[]>> _blocks;
+    size_t _block{0};
+    size_t _block_used{0};
+
+public:
+    size_t lost{0};
+    size_t stale{0};
+
+    /**
+     * Restore packet of a header compressed frame
+     * @return packet valid until reset(), empty if frame is malformed or its context is lost
+     */
+    std::string_view decompress(std::string_view frame) {
+        if (frame.size() < H::PREFIX_SIZE) {
+            return {};
+        }
+        auto changes = (uint8_t) frame[0];
+        auto & context = _contexts[(uint8_t) frame[1]];
+        auto sequence = H::get16(reinterpret_cast<const uint8_t *>(frame.data()) + 2);
+        frame.remove_prefix(H::PREFIX_SIZE);
+
+        // Sequence numbers wrap around
+        if (context.seen && (int16_t) (sequence - context.sequence) <= 0) {
+            stale++;
+            H::Headers headers;
+            return changes & H::FULL && H::parse(frame, headers) ? frame : std::string_view();
+        }
+        context.seen = true;
+
+        if (changes & H::FULL) {
+            H::Headers headers;
+            if (!H::parse(frame, headers)) {
+                context.valid = false;
+                context.sequence = sequence;
+                return {};
+            }
+            context.valid = true;
+            context.sequence = sequence;
+            std::memcpy(context.header.data(), headers.data, headers.header_size);
+            context.header_size = headers.header_size;
+            context.timestamp_offset = headers.timestamp_offset;
+            return frame;
+        }
+
+        if (!context.valid || sequence != (uint16_t) (context.sequence + 1)) {
+            if (context.valid) {
+                lost++;
+            }
+            context.valid = false;
+            context.sequence = sequence;
+            return {};
+        }
+        auto header = context.header;
+        if (!_applyChanges(changes, frame, header.data(), context)) {
+            context.valid = false;
+            context.sequence = sequence;
+            return {};
+        }
+
+        auto size = context.header_size + frame.size();
+        if (size > BLOCK_SIZE) {
+            context.valid = false;
+            context.sequence = sequence;
+            return {};
+        }
+        auto packet = _allocate(size);
+        std::memcpy(packet, header.data(), context.header_size);
+        std::memcpy(packet + context.header_size, frame.data(), frame.size());
+        H::finish(packet, size, header[9]);
+
+        context.sequence = sequence;
+        std::memcpy(context.header.data(), packet, context.header_size);
+        return {reinterpret_cast<const char *>(packet), size};
+    }
+
+    /**
+     * Drop every context, when the compressor started over
+     */
+    void forget() {
+        for (auto & context : _contexts) {
+            context.valid = false;
+            context.seen = false;
+        }
+    }
+
+    /**
+     * Release restored packets
+     */
+    void reset() {
+        _block = 0;
+        _block_used = 0;
+    }
+
+private:
+    static bool _applyChanges(uint8_t changes, std::string_view & in, uint8_t * header, const Context & context) {
+        uint32_t value;
+        uint16_t id_delta = 1;
+        if (changes & H::CHANGED_IP_ID) {
+            if (!H::getNumber(in, value)) {
+                return false;
+            }
+            id_delta = (uint16_t) value;
+        }
+        H::set16(header + 4, (uint16_t) (H::get16(header + 4) + id_delta));
+        if (header[9] == H::PROTOCOL_UDP) {
+            return !(changes & ~H::CHANGED_IP_ID);
+        }
+
+        auto tcp = header + H::IP_HEADER_SIZE;
+        if (changes & H::CHANGED_TCP_SEQ) {
+            if (!H::getNumber(in, value)) {
+                return false;
+            }
+            H::set32(tcp + 4, H::get32(tcp + 4) + value);
+        }
+        if (changes & H::CHANGED_TCP_ACK) {
+            if (!H::getNumber(in, value)) {
+                return false;
+            }
+            H::set32(tcp + 8, H::get32(tcp + 8) + value);
+        }
+        if (changes & H::CHANGED_TCP_WINDOW) {
+            if (!H::getNumber(in, value)) {
+                return false;
+            }
+            H::set16(tcp + 14, (uint16_t) value);
+        }
+        if (changes & H::CHANGED_TCP_FLAGS) {
+            if (in.empty()) {
+                return false;
+            }
+            tcp[13] = (uint8_t) in.front();
+            in.remove_prefix(1);
+        }
+        if (changes & H::CHANGED_TCP_TIMESTAMP) {
+            auto offset = context.timestamp_offset;
+            uint32_t echo;
+            if (!offset || !H::getNumber(in, value) || !H::getNumber(in, echo)) {
+                return false;
+            }
+            H::set32(header + offset, H::get32(header + offset) + value);
+            H::set32(header + offset + 4, H::get32(header + offset + 4) + echo);
+        }
+        return true;
+    }
+
+    uint8_t * _allocate(size_t size) {
+        if (_block < _blocks.size() && _block_used + size > BLOCK_SIZE) {
+            _block++;
+            _block_used = 0;
+        }
+        if (_block == _blocks.size()) {
+            _blocks.emplace_back(new uint8_t[BLOCK_SIZE]);
+        }
+        auto data = _blocks[_block].get() + _block_used;
+        _block_used += size;
+        return data;
+    }
+};
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+#include <fmt/format.h>
+#include "transport.hpp"
+
+
+/**
+ * Telegram behaviour simulated by LoopbackLink.
+ * Zero values disable the corresponding simulation.
+ */
+struct LoopbackOptions {
+    /** One-way delivery latency */
+    std::chrono::microseconds latency{0};
+    /** Uniformly distributed +/- jitter added to latency, may reorder messages */
+    std::chrono::microseconds jitter{0};
+    /** Maximum message length in UTF-16 code units, like Telegram counts it */
+    size_t max_message_size{0};
+    /** Per-endpoint send rate, exceeding it triggers FLOOD_WAIT */
+    float max_messages_per_second{0};
+    /** FLOOD_WAIT duration once the send rate is exceeded */
+    std::chrono::seconds flood_wait{1};
+    /** Fraction of sends failing with a transient error */
+    double error_rate{0};
+    /** Upload speed of documents added to their latency */
+    double document_bytes_per_second{0};
+};
+
+
+class LoopbackLink;
+
+/**
+ * One end of an in-process LoopbackLink.
+ * Messages sent to any chat are delivered to the other end, which sees them
+ * as coming from this end's user_id.
+ */
+class LoopbackTransport : public Transport {
+    friend class LoopbackLink;
+
+    LoopbackLink & _link;
+    std::int64_t _user_id;
+    LoopbackTransport * _peer{nullptr};
+
+    double _tokens{0};
+    std::chrono::steady_clock::time_point _tokens_updated{};
+    std::chrono::steady_clock::time_point _flood_until{};
+
+public:
+    LoopbackTransport(LoopbackLink & link, std::int64_t user_id) : _link(link), _user_id(user_id) {}
+
+    std::int64_t userId() const {
+        return _user_id;
+    }
+
+    void sendTextMessage(std::int64_t chat_id, std::string text, SendHandler handler) override;
+
+    bool supportsDocuments() const override {
+        return true;
+    }
+
+    void sendDocument(std::int64_t chat_id, std::string caption, std::string data, SendHandler handler) override;
+};
+
+
+/**
+ * Pair of connected LoopbackTransport endpoints and the thread that delivers
+ * send results and messages between them.
+ */
+class LoopbackLink {
+    friend class LoopbackTransport;
+
+    using clock = std::chrono::steady_clock;
+
+    struct Event {
+        clock::time_point time;
+        std::uint64_t sequence;
+        std::function<void()> callback;
+
+        bool operator>(const Event & other) const {
+            return time != other.time ? time > other.time : sequence > other.sequence;
+        }
+    };
+
+    LoopbackOptions _options;
+    LoopbackTransport _first;
+    LoopbackTransport _second;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::priority_queue<Event, std::vector<Event>, std::greater<>> _events;
+    std::uint64_t _sequence{0};
+    std::int64_t _message_id{0};
+    std::mt19937 _random{std::random_device{}()};
+
+    std::atomic<bool> _running{true};
+    std::thread _thread;
+
+public:
+    explicit LoopbackLink(LoopbackOptions options = {}, std::int64_t first_user_id = 1, std::int64_t second_user_id = 2)
+        : _options(options), _first(*this, first_user_id), _second(*this, second_user_id)
+    {
+        _first._peer = &_second;
+        _second._peer = &_first;
+        _thread = std::thread([this]() { _run(); });
+    }
+
+    ~LoopbackLink() {
+        {
+            std::scoped_lock lock(_mutex);
+            _running = false;
+        }
+        _cv.notify_all();
+        _thread.join();
+    }
+
+    LoopbackLink(const LoopbackLink &) = delete;
+    LoopbackLink & operator=(const LoopbackLink &) = delete;
+
+    LoopbackTransport & first() {
+        return _first;
+    }
+
+    LoopbackTransport & second() {
+        return _second;
+    }
+
+    const LoopbackOptions & options() const {
+        return _options;
+    }
+
+    /**
+     * Length of UTF-8 text in UTF-16 code units
+     */
+    static size_t utf16Length(std::string_view text) {
+        size_t length = 0;
+        for (char c : text) {
+            auto byte = static_cast<unsigned char>(c);
+            if ((byte & 0xC0) != 0x80) {
+                length += byte >= 0xF0 ? 2 : 1;
+            }
+        }
+        return length;
+    }
+
+private:
+    void _schedule(clock::time_point time, std::function<void()> callback) {
+        {
+            std::scoped_lock lock(_mutex);
+            _events.push(Event{time, _sequence++, std::move(callback)});
+        }
+        _cv.notify_one();
+    }
+
+    /**
+     * @param document - content of a document captioned with text, empty for a text message
+     */
+    void _send(LoopbackTransport & from, std::int64_t /*chat_id*/, std::string text, std::string document, Transport::SendHandler handler) {
+        auto now = clock::now();
+        SendResult result;
+        clock::time_point delivery_time;
+        {
+            std::scoped_lock lock(_mutex);
+            if (_options.max_message_size && utf16Length(text) > _options.max_message_size) {
+                result.error_code = 400;
+                result.error_message = "MESSAGE_TOO_LONG";
+            } else if (_options.error_rate > 0 && std::uniform_real_distribution<double>(0, 1)(_random) < _options.error_rate) {
+                result.error_code = 500;
+                result.error_message = "INTERNAL_SERVER_ERROR";
+            } else if (now < from._flood_until) {
+                auto wait = std::chrono::duration<double>(from._flood_until - now).count();
+                result.error_code = 429;
+                result.error_message = fmt::format("Too Many Requests: retry after {}", (int64_t) std::ceil(wait));
+            } else if (_options.max_messages_per_second > 0 && !_takeToken(from, now)) {
+                from._flood_until = now + _options.flood_wait;
+                result.error_code = 429;
+                result.error_message = fmt::format("Too Many Requests: retry after {}", _options.flood_wait.count());
+            } else {
+                result.ok = true;
+                result.message_id = ++_message_id;
+                auto delay = _options.latency;
+                if (_options.jitter.count() > 0) {
+                    std::uniform_int_distribution<int64_t> distribution(-_options.jitter.count(), _options.jitter.count());
+                    delay += std::chrono::microseconds(distribution(_random));
+                }
+                if (!document.empty() && _options.document_bytes_per_second > 0) {
+                    delay += std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::duration<double>((double) document.size() / _options.document_bytes_per_second));
+                }
+                delivery_time = now + std::max(delay, std::chrono::microseconds(0));
+            }
+        }
+
+        if (result.ok) {
+            _schedule(delivery_time,
+                [to = from._peer, sender_id = from._user_id, message_id = result.message_id, text = std::move(text), document = std::move(document)]() {
+                    // In a private chat the peer sees the sender's user id as the chat id
+                    to->_deliverMessage(ReceivedMessage{sender_id, sender_id, message_id, text, document});
+                });
+        }
+        if (handler) {
+            _schedule(now, [handler = std::move(handler), result = std::move(result)]() {
+                handler(result);
+            });
+        }
+    }
+
+    bool _takeToken(LoopbackTransport & from, clock::time_point now) {
+        double burst = std::max(1.f, _options.max_messages_per_second);
+        if (from._tokens_updated == clock::time_point{}) {
+            from._tokens = burst;
+        } else {
+            auto elapsed = std::chrono::duration<double>(now - from._tokens_updated).count();
+            from._tokens = std::min(burst, from._tokens + elapsed * _options.max_messages_per_second);
+        }
+        from._tokens_updated = now;
+        if (from._tokens < 1) {
+            return false;
+        }
+        from._tokens -= 1;
+        return true;
+    }
+
+    void _run() {
+        std::unique_lock lock(_mutex);
+        while (_running) {
+            if (_events.empty()) {
+                _cv.wait(lock);
+                continue;
+            }
+            if (clock::now() < _events.top().time) {
+                _cv.wait_until(lock, _events.top().time);
+                continue;
+            }
+            auto callback = std::move(const_cast<Event &>(_events.top()).callback);
+            _events.pop();
+            lock.unlock();
+            callback();
+            lock.lock();
+        }
+    }
+};
+
+
+inline void LoopbackTransport::sendTextMessage(std::int64_t chat_id, std::string text, SendHandler handler) {
+    _link._send(*this, chat_id, std::move(text), {}, std::move(handler));
+}
+
+inline void LoopbackTransport::sendDocument(std::int64_t chat_id, std::string caption, std::string data, SendHandler handler) {
+    _link._send(*this, chat_id, std::move(caption), std::move(data), std::move(handler));
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+
+/**
+ * IDs of tunnel messages to delete, handed out in batches of up to
+ * BATCH_MAX of one chat. A message is due delay after it was added, a batch
+ * is ready once BATCH_MAX messages are due or the oldest one waited
+ * BATCH_WAIT, so deleting takes few requests.
+ * Not thread-safe.
+ */
+class MessageReaper {
+public:
+    using clock = std::chrono::steady_clock;
+
+    /** Message IDs per deleteMessages at most */
+    static constexpr size_t BATCH_MAX = 100;
+    static constexpr clock::duration BATCH_WAIT = std::chrono::seconds(5);
+
+private:
+    struct Entry {
+        std::int64_t chat_id;
+        std::int64_t message_id;
+        clock::time_point due;
+    };
+
+    clock::duration _delay;
+    std::deque<Entry> _entries;
+
+public:
+    explicit MessageReaper(clock::duration delay) : _delay(delay) {}
+
+    size_t size() const {
+        return _entries.size();
+    }
+
+    void add(std::int64_t chat_id, std::int64_t message_id, clock::time_point now) {
+        _entries.push_back({chat_id, message_id, now + _delay});
+    }
+
+    bool ready(clock::time_point now) const {
+        if (_entries.empty() || _entries.front().due > now) {
+            return false;
+        }
+        return _entries.front().due + BATCH_WAIT <= now
+            || (_entries.size() >= BATCH_MAX && _entries[BATCH_MAX - 1].due <= now);
+    }
+
+    /**
+     * Take due messages of the chat of the oldest one
+     * @return chat ID, message_ids is empty if nothing is due
+     */
+    std::int64_t take(clock::time_point now, std::vector<std::int64_t> & message_ids) {
+        message_ids.clear();
+        if (_entries.empty()) {
+            return 0;
+        }
+        auto chat_id = _entries.front().chat_id;
+        for (auto it = _entries.begin(); it != _entries.end() && it->due <= now && message_ids.size() < BATCH_MAX; ) {
+            if (it->chat_id != chat_id) {
+                ++it;
+                continue;
+            }
+            message_ids.push_back(it->message_id);
+            it = _entries.erase(it);
+        }
+        return chat_id;
+    }
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <arpa/inet.h>
+#include <fmt/format.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "process_usage.hpp"
+#include "stats.hpp"
+#include "utils.hpp"
+
+
+/**
+ * Render stats in the Prometheus text exposition format 0.0.4, whose
+ * TYPE lines name the sample, _total suffix of counters included
+ * @param message_capacity - payload capacity of one message, for the fill ratio
+ * @param first_packet_seconds - time from start to the first received packet, 0 if none yet
+ */
+inline std::string formatMetrics(const Stats::Snapshot & snapshot, size_t message_capacity,
+    const ProcessUsage & usage, double first_packet_seconds) {
+    std::string out;
+    auto it = std::back_inserter(out);
+    for (size_t i = 0; i < COUNTER_COUNT; i++) {
+        fmt::format_to(it, "# TYPE iot_{0}_total counter\niot_{0}_total {1}\n", Stats::COUNTER_NAMES[i], snapshot.counters[i]);
+    }
+    for (size_t h = 0; h < HISTOGRAM_COUNT; h++) {
+        auto name = fmt::format("iot_{}_{}", Stats::HISTOGRAM_NAMES[h], Stats::HISTOGRAM_UNITS[h]);
+        auto scale = Stats::HISTOGRAM_SCALES[h];
+        fmt::format_to(it, "# TYPE {} histogram\n", name);
+        uint64_t total = 0;
+        for (size_t i = 0; i < Stats::BUCKETS; i++) {
+            total += snapshot.histograms[h][i];
+            fmt::format_to(it, "{}_bucket{{le=\"{}\"}} {}\n", name, (double) ((uint64_t) 1 << i) * scale, total);
+        }
+        fmt::format_to(it, "{0}_bucket{{le=\"+Inf\"}} {1}\n{0}_sum {2}\n{0}_count {1}\n", name, total, (double) snapshot.sums[h] * scale);
+    }
+    auto messages = snapshot.counters[OUT_MESSAGES];
+    fmt::format_to(it, "# TYPE iot_out_message_fill_ratio gauge\niot_out_message_fill_ratio {}\n",
+        messages ? (double) snapshot.counters[OUT_PAYLOAD_BYTES] / (double) (messages * message_capacity) : 0.);
+    fmt::format_to(it, "# TYPE iot_out_message_bytes gauge\niot_out_message_bytes {}\n",
+        messages ? (double) snapshot.counters[OUT_TEXT_BYTES] / (double) messages : 0.);
+    auto packets = snapshot.counters[OUT_TUN_READ_OK] + snapshot.counters[IN_WRITE_OK];
+    fmt::format_to(it, "# TYPE iot_process_resident_memory_bytes gauge\niot_process_resident_memory_bytes {}\n", usage.resident_bytes);
+    fmt::format_to(it, "# TYPE iot_process_disk_write_bytes_total counter\niot_process_disk_write_bytes_total {}\n", usage.disk_write_bytes);
+    fmt::format_to(it, "# TYPE iot_disk_write_bytes_per_packet gauge\niot_disk_write_bytes_per_packet {}\n",
+        packets ? (double) usage.disk_write_bytes / (double) packets : 0.);
+    fmt::format_to(it, "# TYPE iot_first_packet_seconds gauge\niot_first_packet_seconds {}\n", first_packet_seconds);
+    return out;
+}
+
+
+/**
+ * Minimal HTTP server answering every request with the rendered metrics.
+ * Serves one connection at a time on its own thread.
+ */
+class MetricsServer {
+    std::function<std::string()> _render;
+    int _listen_fd{-1};
+    int _wakeup_fd{-1};
+    std::atomic<bool> _running{false};
+    std::thread _thread;
+
+public:
+    MetricsServer(const std::string & address, int port, std::function<std::string()> render) : _render(std::move(render)) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t) port);
+        if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+            throw std::runtime_error("Invalid metrics address: " + address);
+        }
+        _listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (_listen_fd < 0 || bind(_listen_fd, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(_listen_fd, 8) != 0) {
+            auto error = std::string("Failed to listen for metrics on ") + address + ":" + std::to_string(port) + ": " + std::strerror(errno);
+            if (_listen_fd >= 0) {
+                ::close(_listen_fd);
+            }
+            throw std::runtime_error(error);
+        }
+        _wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    ~MetricsServer() {
+        stop();
+        ::close(_listen_fd);
+        ::close(_wakeup_fd);
+    }
+
+    MetricsServer(const MetricsServer &) = delete;
+    MetricsServer & operator=(const MetricsServer &) = delete;
+
+    void start() {
+        if (_running) {
+            return;
+        }
+        _running = true;
+        _thread = std::thread([this]() {
+            while (_running) {
+                pollfd fds[2] = {{_listen_fd, POLLIN, 0}, {_wakeup_fd, POLLIN, 0}};
+                if (poll(fds, 2, -1) <= 0 || !(fds[0].revents & POLLIN)) {
+                    continue;
+                }
+                int fd = accept4(_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd < 0) {
+                    continue;
+                }
+                _serve(fd);
+                ::close(fd);
+            }
+        });
+    }
+
+    void stop() {
+        if (!_running) {
+            return;
+        }
+        _running = false;
+        uint64_t wakeup = 1;
+        if (::write(_wakeup_fd, &wakeup, sizeof(wakeup)) < 0) {
+            println(stderr, "Failed to wake up metrics thread: {}", std::strerror(errno));
+        }
+        _thread.join();
+        uint64_t wakeups;
+        while (::read(_wakeup_fd, &wakeups, sizeof(wakeups)) > 0) {}
+    }
+
+private:
+    void _serve(int fd) {
+        // Read the request head, its content does not matter
+        char request[4096];
+        size_t received = 0;
+        while (received < sizeof(request)) {
+            pollfd pfd{fd, POLLIN, 0};
+            if (poll(&pfd, 1, 1000) <= 0) {
+                return;
+            }
+            auto n = ::recv(fd, request + received, sizeof(request) - received, 0);
+            if (n <= 0) {
+                return;
+            }
+            received += (size_t) n;
+            if (std::string_view(request, received).find("\r\n\r\n") != std::string_view::npos) {
+                break;
+            }
+        }
+
+        auto body = _render();
+        auto response = fmt::format(
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+            "Content-Length: {}\r\n"
+            "Connection: close\r\n"
+            "\r\n"
+            "{}", body.size(), body);
+        for (size_t sent = 0; sent < response.size(); ) {
+            auto n = ::send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return;
+            }
+            sent += (size_t) n;
+        }
+    }
+};
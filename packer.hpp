@@ -0,0 +1,291 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+
+/**
+ * Payload of a tunnel message is a sequence of frames:
+ *   [uint16 length] [packet]                                 whole packet
+ *   [uint16 length | COMPRESSED] [data]                      whole packet with
+ *                                                            compressed headers
+ *   [uint16 length | FRAGMENT(| LAST)] [uint16 id] [uint16 offset] [data]
+ *                                                            part of a packet
+ * Integers are in host byte order. A packet that does not fit into the room
+ * left in a message is split into fragments carried by consecutive messages.
+ */
+struct Frame {
+    static constexpr uint16_t FRAGMENT = 0x8000;
+    static constexpr uint16_t LAST = 0x4000;
+    /** Shares the bit with LAST, which only fragments have */
+    static constexpr uint16_t COMPRESSED = 0x4000;
+    static constexpr uint16_t LENGTH_MASK = 0x3FFF;
+
+    static constexpr size_t HEADER_SIZE = sizeof(uint16_t);
+    static constexpr size_t FRAGMENT_HEADER_SIZE = 3 * sizeof(uint16_t);
+
+    /** Do not start a fragment in less room than this, send the message instead */
+    static constexpr size_t MIN_FRAGMENT_SIZE = 64;
+
+    static void put(std::string & payload, uint16_t value) {
+        payload.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    static uint16_t get(const char * data) {
+        uint16_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    /**
+     * Size of the longest run of whole frames at the start of payload not exceeding max_size
+     */
+    static size_t prefix(std::string_view payload, size_t max_size) {
+        size_t size = 0;
+        while (payload.size() - size >= HEADER_SIZE) {
+            auto header = get(payload.data() + size);
+            auto frame = (header & FRAGMENT ? FRAGMENT_HEADER_SIZE : HEADER_SIZE) + (header & LENGTH_MASK);
+            if (size + frame > max_size || size + frame > payload.size()) {
+                break;
+            }
+            size += frame;
+        }
+        return size;
+    }
+};
+
+
+/**
+ * Fills message payloads up to a byte capacity, fragmenting packets that do
+ * not fit. Completed payloads are passed to the callback.
+ * Frames never exceed the initial capacity, so a payload packed to a larger
+ * capacity can still be split into messages of the initial one.
+ */
+class MessagePacker {
+    size_t _capacity;
+    size_t _frame_max;
+    std::string _payload;
+    uint16_t _fragment_id{0};
+
+public:
+    explicit MessagePacker(size_t capacity) : _capacity(capacity), _frame_max(capacity) {
+        _payload.reserve(_capacity);
+    }
+
+    size_t capacity() const {
+        return _capacity;
+    }
+
+    /**
+     * Change capacity for the following packets, it is never below the initial one
+     */
+    void setCapacity(size_t capacity) {
+        _capacity = std::max(capacity, _frame_max);
+        _payload.reserve(_capacity);
+    }
+
+    size_t size() const {
+        return _payload.size();
+    }
+
+    bool empty() const {
+        return _payload.empty();
+    }
+
+    /**
+     * Bytes left in the current message
+     */
+    size_t room() const {
+        return _capacity > _payload.size() ? _capacity - _payload.size() : 0;
+    }
+
+    /**
+     * Size of payload needed for packet if appended to an empty message
+     */
+    static size_t frameSize(size_t packet_size) {
+        return Frame::HEADER_SIZE + packet_size;
+    }
+
+    template <typename OnPayload>
+    void add(std::string_view packet, OnPayload && on_payload) {
+        bool whole = frameSize(packet.size()) <= _frame_max;
+        if (whole && _payload.size() + frameSize(packet.size()) <= _capacity) {
+            Frame::put(_payload, (uint16_t) packet.size());
+            _payload.append(packet);
+            return;
+        }
+        if (whole && room() < Frame::FRAGMENT_HEADER_SIZE + Frame::MIN_FRAGMENT_SIZE) {
+            // Fits as a whole into the next message
+            flush(on_payload);
+            add(packet, on_payload);
+            return;
+        }
+
+        auto id = _fragment_id++;
+        size_t offset = 0;
+        while (offset < packet.size()) {
+            if (!_payload.empty() && room() < Frame::FRAGMENT_HEADER_SIZE + Frame::MIN_FRAGMENT_SIZE) {
+                flush(on_payload);
+            }
+            auto chunk = std::min(packet.size() - offset, std::min(room(), _frame_max) - Frame::FRAGMENT_HEADER_SIZE);
+            bool last = offset + chunk == packet.size();
+            Frame::put(_payload, (uint16_t) (chunk | Frame::FRAGMENT | (last ? Frame::LAST : 0)));
+            Frame::put(_payload, id);
+            Frame::put(_payload, (uint16_t) offset);
+            _payload.append(packet.substr(offset, chunk));
+            offset += chunk;
+            if (!last) {
+                flush(on_payload);
+            }
+        }
+    }
+
+    /**
+     * Append packet with compressed headers, it is never fragmented
+     * @return false if it does not fit into room()
+     */
+    bool addCompressed(std::string_view data) {
+        if (frameSize(data.size()) > room()) {
+            return false;
+        }
+        Frame::put(_payload, (uint16_t) (data.size() | Frame::COMPRESSED));
+        _payload.append(data);
+        return true;
+    }
+
+    /**
+     * Whether add() of packet would send the current message first
+     */
+    bool wouldFlush(size_t packet_size) const {
+        return !_payload.empty() && frameSize(packet_size) > room()
+            && room() < Frame::FRAGMENT_HEADER_SIZE + Frame::MIN_FRAGMENT_SIZE;
+    }
+
+    template <typename OnPayload>
+    void flush(OnPayload && on_payload) {
+        if (_payload.empty()) {
+            return;
+        }
+        on_payload(std::string_view(_payload));
+        _payload.clear();
+    }
+};
+
+
+/**
+ * Parses message payloads and reassembles fragmented packets.
+ * Keeps a few partially received packets, the oldest one is evicted first.
+ */
+class MessageUnpacker {
+    struct Partial {
+        bool used{false};
+        /** Completed during the current unpack(), its data is still referenced */
+        bool done{false};
+        uint16_t id{0};
+        std::string data;
+        size_t received{0};
+        size_t total{0};
+        uint64_t age{0};
+
+        /** Keeps data capacity for the next packet */
+        void reset() {
+            used = false;
+            done = false;
+            data.clear();
+            received = total = 0;
+        }
+    };
+
+    std::array<Partial, 16> _partials;
+    uint64_t _age{0};
+
+public:
+    size_t evicted{0};
+
+    /**
+     * Pass every complete packet of payload to the callback, and packets
+     * with compressed headers to on_compressed.
+     * Packets point into payload or reassembly buffers and stay valid until
+     * the next unpack() call.
+     * @return false if payload is malformed
+     */
+    template <typename OnPacket, typename OnCompressed>
+    bool unpack(std::string_view payload, OnPacket && on_packet, OnCompressed && on_compressed) {
+        for (auto & partial : _partials) {
+            if (partial.done) {
+                partial.reset();
+            }
+        }
+        while (!payload.empty()) {
+            if (payload.size() < Frame::HEADER_SIZE) {
+                return false;
+            }
+            auto header = Frame::get(payload.data());
+            size_t length = header & Frame::LENGTH_MASK;
+            if (!(header & Frame::FRAGMENT)) {
+                if (!length || payload.size() < Frame::HEADER_SIZE + length) {
+                    return false;
+                }
+                if (header & Frame::COMPRESSED) {
+                    on_compressed(payload.substr(Frame::HEADER_SIZE, length));
+                } else {
+                    on_packet(payload.substr(Frame::HEADER_SIZE, length));
+                }
+                payload.remove_prefix(Frame::HEADER_SIZE + length);
+                continue;
+            }
+
+            if (payload.size() < Frame::FRAGMENT_HEADER_SIZE + length) {
+                return false;
+            }
+            auto id = Frame::get(payload.data() + sizeof(uint16_t));
+            size_t offset = Frame::get(payload.data() + 2 * sizeof(uint16_t));
+            auto data = payload.substr(Frame::FRAGMENT_HEADER_SIZE, length);
+            payload.remove_prefix(Frame::FRAGMENT_HEADER_SIZE + length);
+
+            auto & partial = _find(id);
+            if (partial.data.size() < offset + length) {
+                partial.data.resize(offset + length);
+            }
+            std::memcpy(partial.data.data() + offset, data.data(), length);
+            partial.received += length;
+            if (header & Frame::LAST) {
+                partial.total = offset + length;
+            }
+            if (partial.total && partial.received >= partial.total) {
+                on_packet(std::string_view(partial.data).substr(0, partial.total));
+                partial.used = false;
+                partial.done = true;
+            }
+        }
+        return true;
+    }
+
+private:
+    Partial & _find(uint16_t id) {
+        Partial * oldest = &_partials[0];
+        for (auto & partial : _partials) {
+            if (partial.used && partial.id == id) {
+                return partial;
+            }
+            if (partial.done) {
+                continue;
+            }
+            if (!partial.used || (oldest->used && partial.age < oldest->age) || oldest->done) {
+                oldest = &partial;
+            }
+        }
+        if (oldest->used) {
+            evicted++;
+        }
+        oldest->reset();
+        oldest->used = true;
+        oldest->id = id;
+        oldest->age = _age++;
+        return *oldest;
+    }
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+/**
+ * Source and sink of IP packets for the Tunnel.
+ * read() returns the packet size, 0 if no packet is available or -1 on error.
+ * writeBatch() returns the number of packets written, a packet that fails does
+ * not keep later ones from being written.
+ */
+class PacketDevice {
+public:
+    virtual ~PacketDevice() = default;
+
+    virtual int read(void * buffer, size_t size) = 0;
+    virtual int write(const void * buffer, size_t size) = 0;
+    virtual int nativeHandle() const = 0;
+
+    virtual size_t writeBatch(const std::string_view * packets, size_t count) {
+        size_t written = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (write(packets[i].data(), packets[i].size()) == (int) packets[i].size()) {
+                written++;
+            }
+        }
+        return written;
+    }
+};
+
+
+/**
+ * Non-blocking packet device over a file descriptor that preserves packet
+ * boundaries, such as a TUN queue or a SOCK_SEQPACKET socket.
+ */
+class FdPacketDevice : public PacketDevice {
+protected:
+    int _fd{-1};
+
+public:
+    int read(void * buffer, size_t size) override {
+        auto n = ::read(_fd, buffer, size);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        return (int) n;
+    }
+
+    int write(const void * buffer, size_t size) override {
+        return (int) ::write(_fd, buffer, size);
+    }
+
+    int nativeHandle() const override {
+        return _fd;
+    }
+};
+
+
+/**
+ * In-process stand-in for a TUN device.
+ * The tunnel side is non-blocking like TUN, the host side is what the kernel
+ * would see: packets written to hostHandle() are read by the tunnel and
+ * packets written by the tunnel are read from hostHandle().
+ */
+class PipeDevice : public FdPacketDevice {
+    int _host_fd{-1};
+
+public:
+    PipeDevice() {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) != 0) {
+            throw std::runtime_error(std::string("socketpair failed: ") + std::strerror(errno));
+        }
+        _fd = fds[0];
+        _host_fd = fds[1];
+        fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+        // A whole message worth of packets is written at once, like to a TUN queue
+        int buffer_size = 4 << 20;
+        for (int fd : fds) {
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+        }
+    }
+
+    ~PipeDevice() override {
+        ::close(_fd);
+        ::close(_host_fd);
+    }
+
+    PipeDevice(const PipeDevice &) = delete;
+    PipeDevice & operator=(const PipeDevice &) = delete;
+
+    int hostHandle() const {
+        return _host_fd;
+    }
+
+    /**
+     * Packets with sendmmsg() calls of up to BATCH_MAX each, one that fails is skipped
+     */
+    size_t writeBatch(const std::string_view * packets, size_t count) override {
+        constexpr size_t BATCH_MAX = 64;
+        size_t written = 0;
+        size_t next = 0;
+        while (next < count) {
+            iovec iovecs[BATCH_MAX];
+            mmsghdr messages[BATCH_MAX] = {};
+            size_t n = std::min(BATCH_MAX, count - next);
+            for (size_t i = 0; i < n; i++) {
+                iovecs[i] = {const_cast<char *>(packets[next + i].data()), packets[next + i].size()};
+                messages[i].msg_hdr.msg_iov = &iovecs[i];
+                messages[i].msg_hdr.msg_iovlen = 1;
+            }
+            int sent = sendmmsg(_fd, messages, (unsigned) n, 0);
+            if (sent > 0) {
+                written += (size_t) sent;
+                next += (size_t) sent;
+            }
+            if (sent < (int) n) {
+                // sendmmsg() stops at the packet that failed
+                next++;
+            }
+        }
+        return written;
+    }
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+
+/**
+ * Resident memory and storage I/O of this process, from /proc/self.
+ * Fields are 0 where /proc is not available.
+ */
+struct ProcessUsage {
+    std::uint64_t resident_bytes{0};
+    /** Bytes read from and written to storage, not the page cache */
+    std::uint64_t disk_read_bytes{0};
+    std::uint64_t disk_write_bytes{0};
+
+    static ProcessUsage current() {
+        ProcessUsage usage;
+        std::string key;
+        std::uint64_t value;
+        std::ifstream status("/proc/self/status");
+        while (status >> key) {
+            if (key == "VmRSS:" && status >> value) {
+                usage.resident_bytes = value * 1024;
+                break;
+            }
+            std::getline(status, key);
+        }
+        std::ifstream io("/proc/self/io");
+        while (io >> key >> value) {
+            if (key == "read_bytes:") {
+                usage.disk_read_bytes = value;
+            } else if (key == "write_bytes:") {
+                usage.disk_write_bytes = value;
+            }
+        }
+        return usage;
+    }
+};
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <algorithm>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+
+/**
+ * Puts sequenced messages of one peer back in order and drops duplicates.
+ *
+ * Messages ahead of the next expected one wait in up to WINDOW slots until
+ * the gap is filled or the oldest one waited for timeout, then the gap is
+ * skipped. Messages that arrive after their gap was skipped are delivered
+ * late rather than lost. Sequence numbers of the last DUPLICATES delivered
+ * messages are remembered, so a redelivered message is dropped.
+ * A jump of more than DUPLICATES either way, like after the peer restarts with
+ * a new random sequence, starts over and is counted in resynced, not skipped.
+ *
+ * Message is the type stored in slots, reused to keep its buffers.
+ * Not thread-safe.
+ */
+template <typename Message>
+class ReorderBuffer {
+public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr uint32_t WINDOW = 128;
+    static constexpr uint32_t DUPLICATES = 1024;
+
+    enum Action {
+        /** Deliver now, then call release() */
+        DELIVER,
+        /** Fill store() with the message */
+        STORE,
+        /** Already delivered or stored */
+        DROP,
+    };
+
+private:
+    struct Slot {
+        bool used{false};
+        clock::time_point time;
+        Message message;
+    };
+
+    clock::duration _timeout;
+    bool _started{false};
+    uint32_t _next{0};
+    std::vector<Slot> _slots;
+    size_t _stored{0};
+    /** Delivered flags of sequence numbers in [_next - DUPLICATES, _next), by sequence % DUPLICATES */
+    std::bitset<DUPLICATES> _delivered;
+
+public:
+    size_t skipped{0};
+    size_t late{0};
+    size_t resynced{0};
+
+    /**
+     * @param timeout - longest wait for a missing message, 0 to never wait
+     */
+    explicit ReorderBuffer(clock::duration timeout) : _timeout(timeout), _slots(WINDOW) {}
+
+    bool empty() const {
+        return !_stored;
+    }
+
+    /**
+     * Decide what to do with message of sequence. Stored messages that must
+     * go before it are passed to on_message first.
+     */
+    template <typename OnMessage>
+    Action accept(uint32_t sequence, OnMessage && on_message) {
+        if (!_started) {
+            _started = true;
+            _next = sequence;
+        }
+        auto distance = (int32_t) (sequence - _next);
+        if (distance < 0) {
+            if ((uint32_t) -distance > DUPLICATES) {
+                // The peer started over
+                _reset(on_message);
+                resynced++;
+                _next = sequence;
+                _advance(true);
+                return DELIVER;
+            }
+            if (_delivered[sequence % DUPLICATES]) {
+                return DROP;
+            }
+            _delivered[sequence % DUPLICATES] = true;
+            late++;
+            return DELIVER;
+        }
+        if (distance == 0) {
+            _advance(true);
+            return DELIVER;
+        }
+        if ((uint32_t) distance >= WINDOW || _timeout == clock::duration::zero()) {
+            // Too far ahead to wait for the gap
+            while (_stored) {
+                _skip(on_message);
+            }
+            // Stored messages are all before sequence
+            auto gap = sequence - _next;
+            if (gap >= DUPLICATES) {
+                // The peer started over, or far too much was lost to tell
+                _delivered.reset();
+                _next = sequence;
+                resynced++;
+            } else {
+                skipped += gap;
+            }
+            while (_next != sequence) {
+                _advance(false);
+            }
+            _advance(true);
+            return DELIVER;
+        }
+        return _slots[sequence % WINDOW].used ? DROP : STORE;
+    }
+
+    /**
+     * Slot to fill with the message accept() returned STORE for
+     */
+    Message & store(uint32_t sequence, clock::time_point now) {
+        auto & slot = _slots[sequence % WINDOW];
+        slot.used = true;
+        slot.time = now;
+        _stored++;
+        return slot.message;
+    }
+
+    /**
+     * Pass stored messages that are next in order to on_message
+     */
+    template <typename OnMessage>
+    void release(OnMessage && on_message) {
+        while (_stored) {
+            auto & slot = _slots[_next % WINDOW];
+            if (!slot.used) {
+                return;
+            }
+            _take(slot, on_message);
+        }
+    }
+
+    /**
+     * Skip gaps stored messages waited for timeout for
+     */
+    template <typename OnMessage>
+    void expire(clock::time_point now, OnMessage && on_message) {
+        while (_stored && deadline() <= now) {
+            _skip(on_message);
+            release(on_message);
+        }
+    }
+
+    /**
+     * Time the oldest stored message stops waiting at, max() if none is stored
+     */
+    clock::time_point deadline() const {
+        auto oldest = clock::time_point::max();
+        if (!_stored) {
+            return oldest;
+        }
+        for (const auto & slot : _slots) {
+            if (slot.used) {
+                oldest = std::min(oldest, slot.time);
+            }
+        }
+        return oldest + _timeout;
+    }
+
+private:
+    void _advance(bool delivered) {
+        _delivered[_next % DUPLICATES] = delivered;
+        _next++;
+    }
+
+    template <typename OnMessage>
+    void _take(Slot & slot, OnMessage && on_message) {
+        slot.used = false;
+        _stored--;
+        _advance(true);
+        on_message(slot.message);
+    }
+
+    /**
+     * Move past the next sequence number, delivering it if stored
+     */
+    template <typename OnMessage>
+    void _skip(OnMessage && on_message) {
+        auto & slot = _slots[_next % WINDOW];
+        if (slot.used) {
+            _take(slot, on_message);
+            return;
+        }
+        skipped++;
+        _advance(false);
+    }
+
+    template <typename OnMessage>
+    void _reset(OnMessage && on_message) {
+        while (_stored) {
+            _skip(on_message);
+        }
+        _delivered.reset();
+    }
+};
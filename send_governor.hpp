@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include "transport.hpp"
+
+
+/**
+ * Token bucket holding up to one second worth of sends, rate 0 is unlimited
+ */
+class TokenBucket {
+public:
+    using clock = std::chrono::steady_clock;
+
+private:
+    double _rate;
+    double _tokens;
+    clock::time_point _updated;
+
+public:
+    explicit TokenBucket(double rate, clock::time_point now = clock::now()) : _rate(rate), _tokens(_burst()), _updated(now) {}
+
+    double rate() const {
+        return _rate;
+    }
+
+    void setRate(double rate, clock::time_point now) {
+        _refill(now);
+        _rate = rate;
+        _tokens = std::min(_tokens, _burst());
+    }
+
+    /** Drop accumulated tokens, the next send waits for a fresh one */
+    void drain(clock::time_point now) {
+        _refill(now);
+        _tokens = std::min(_tokens, 0.);
+    }
+
+    /** Nothing was sent for a while */
+    bool full(clock::time_point now) {
+        _refill(now);
+        return _tokens >= _burst();
+    }
+
+    /** Time the next token is available at */
+    clock::time_point availableAt(clock::time_point now) {
+        _refill(now);
+        if (_tokens >= 1) {
+            return now;
+        }
+        return now + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>((1 - _tokens) / _rate));
+    }
+
+    void take(clock::time_point now) {
+        _refill(now);
+        if (_rate > 0) {
+            _tokens -= 1;
+        }
+    }
+
+private:
+    double _burst() const {
+        return std::max(1., _rate);
+    }
+
+    void _refill(clock::time_point now) {
+        if (_rate > 0) {
+            _tokens = std::min(_burst(), _tokens + std::chrono::duration<double>(now - _updated).count() * _rate);
+        } else {
+            _tokens = _burst();
+        }
+        _updated = now;
+    }
+};
+
+
+/**
+ * Keeps sends to every chat below Telegram rate limits.
+ * Each chat has a token bucket whose rate is increased additively on
+ * successful sends up to max_messages_per_second and halved on FLOOD_WAIT.
+ * FLOOD_WAIT also pauses the chat for the retry-after time.
+ */
+class SendGovernor {
+public:
+    using clock = TokenBucket::clock;
+
+    /** Rate never goes below this */
+    static constexpr double MIN_RATE = 0.2;
+
+private:
+    struct Chat {
+        TokenBucket bucket;
+        clock::time_point paused_until;
+        /** Sends in the current and the previous second, to estimate rate when unlimited */
+        clock::time_point window_begin;
+        size_t window_sent{0};
+        size_t previous_window_sent{0};
+    };
+
+    double _max_rate;
+    std::mutex _mutex;
+    std::unordered_map<std::int64_t, Chat> _chats;
+
+public:
+    explicit SendGovernor(double max_messages_per_second) : _max_rate(max_messages_per_second) {}
+
+    /**
+     * Parse Telegram rate limit error: 429 "Too Many Requests: retry after N" or "FLOOD_WAIT_N"
+     * @return true if result is a rate limit error
+     */
+    static bool parseFloodWait(const SendResult & result, std::chrono::seconds & retry_after) {
+        if (result.ok) {
+            return false;
+        }
+        std::string_view message = result.error_message;
+        for (std::string_view prefix : {"retry after ", "FLOOD_WAIT_"}) {
+            auto pos = message.find(prefix);
+            if (pos == std::string_view::npos) {
+                continue;
+            }
+            auto number = message.substr(pos + prefix.size());
+            int64_t seconds = 0;
+            std::from_chars(number.data(), number.data() + number.size(), seconds);
+            retry_after = std::chrono::seconds(std::max<int64_t>(seconds, 1));
+            return true;
+        }
+        if (result.error_code == 429) {
+            retry_after = std::chrono::seconds(1);
+            return true;
+        }
+        return false;
+    }
+
+    double rate(std::int64_t chat_id) {
+        std::scoped_lock lock(_mutex);
+        return _chat(chat_id).bucket.rate();
+    }
+
+    /** Time the next message to chat may be sent at */
+    clock::time_point sendTime(std::int64_t chat_id, clock::time_point now) {
+        std::scoped_lock lock(_mutex);
+        auto & chat = _chat(chat_id);
+        return std::max(chat.paused_until, chat.bucket.availableAt(now));
+    }
+
+    /** No message was sent to chat for a while and it is not paused */
+    bool idle(std::int64_t chat_id, clock::time_point now) {
+        std::scoped_lock lock(_mutex);
+        auto & chat = _chat(chat_id);
+        return chat.paused_until <= now && chat.bucket.full(now);
+    }
+
+    void onSend(std::int64_t chat_id, clock::time_point now) {
+        std::scoped_lock lock(_mutex);
+        auto & chat = _chat(chat_id);
+        chat.bucket.take(now);
+        if (now - chat.window_begin >= std::chrono::seconds(1)) {
+            chat.previous_window_sent = now - chat.window_begin < std::chrono::seconds(2) ? chat.window_sent : 0;
+            chat.window_sent = 0;
+            chat.window_begin = now;
+        }
+        chat.window_sent++;
+    }
+
+    /**
+     * Adjust chat rate to the send result
+     * @return true if result is a rate limit error
+     */
+    bool onResult(std::int64_t chat_id, const SendResult & result, clock::time_point now) {
+        std::chrono::seconds retry_after;
+        bool flood = parseFloodWait(result, retry_after);
+        if (!flood && !result.ok) {
+            return false;
+        }
+
+        std::scoped_lock lock(_mutex);
+        auto & chat = _chat(chat_id);
+        auto rate = chat.bucket.rate();
+        if (flood) {
+            if (rate <= 0) {
+                rate = (double) std::max(chat.window_sent, chat.previous_window_sent);
+            }
+            chat.paused_until = std::max(chat.paused_until, now + retry_after);
+            chat.bucket.setRate(std::max(MIN_RATE, rate / 2), now);
+            chat.bucket.drain(now);
+        } else if (rate > 0 && (_max_rate <= 0 || rate < _max_rate)) {
+            // About one message per second more for every second of sending at full rate
+            rate += 1 / rate;
+            chat.bucket.setRate(_max_rate > 0 ? std::min(rate, _max_rate) : rate, now);
+        }
+        return flood;
+    }
+
+private:
+    Chat & _chat(std::int64_t chat_id) {
+        auto it = _chats.find(chat_id);
+        if (it == _chats.end()) {
+            auto now = clock::now();
+            it = _chats.emplace(chat_id, Chat{TokenBucket(_max_rate, now), now, now}).first;
+        }
+        return it->second;
+    }
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+
+#define TUNNEL_COUNTERS(X) \
+    X(OUT_TUN_READ_OK, "out_tun_read_ok") \
+    X(OUT_TUN_READ_ERROR, "out_tun_read_error") \
+    X(OUT_BACKPRESSURE, "out_backpressure") \
+    X(OUT_CACHE_INSERTED, "out_cache_inserted") \
+    X(OUT_CACHE_FLUSHED, "out_cache_flushed") \
+    X(OUT_CACHE_PRIORITIZED, "out_cache_prioritized") \
+    X(OUT_CACHE_DROPPED, "out_cache_dropped") \
+    X(OUT_ACKS_THINNED, "out_acks_thinned") \
+    X(OUT_ACKS_THINNED_BYTES, "out_acks_thinned_bytes") \
+    X(OUT_DNS_HIT, "out_dns_hit") \
+    X(OUT_DNS_MISS, "out_dns_miss") \
+    X(OUT_DNS_PREFETCH, "out_dns_prefetch") \
+    X(OUT_MESSAGES, "out_messages") \
+    X(OUT_PAYLOAD_BYTES, "out_payload_bytes") \
+    X(OUT_COMPRESSED, "out_compressed") \
+    X(OUT_COMPRESSED_BYTES, "out_compressed_bytes") \
+    X(OUT_COMPRESS_SKIPPED, "out_compress_skipped") \
+    X(OUT_HEADERS_COMPRESSED, "out_headers_compressed") \
+    X(OUT_HEADERS_FULL, "out_headers_full") \
+    X(OUT_TEXT_BYTES, "out_text_bytes") \
+    X(OUT_DOCUMENTS, "out_documents") \
+    X(OUT_DOCUMENT_BYTES, "out_document_bytes") \
+    X(OUT_SEND_OK, "out_send_ok") \
+    X(OUT_SEND_ERROR, "out_send_error") \
+    X(OUT_FLOOD_WAIT, "out_flood_wait") \
+    X(OUT_RETRANSMIT, "out_retransmit") \
+    X(OUT_RETRANSMIT_STALE, "out_retransmit_stale") \
+    X(OUT_RETRANSMIT_DROPPED, "out_retransmit_dropped") \
+    X(OUT_SEND_OUTGOING, "out_send_outgoing") \
+    X(OUT_SEND_OTHER, "out_send_other") \
+    X(OUT_SEND_UNKNOWN, "out_send_unknown") \
+    X(OUT_SEND_ACKNOWLEDGED, "out_send_acknowledged") \
+    X(OUT_SEND_SUCCEEDED, "out_send_succeeded") \
+    X(OUT_SEND_FAILED, "out_send_failed") \
+    X(OUT_REAPED, "out_reaped") \
+    X(OUT_REAP_ERROR, "out_reap_error") \
+    X(IN_RECEIVE, "in_receive") \
+    X(IN_DOCUMENTS, "in_documents") \
+    X(IN_DNS_PREFETCHED, "in_dns_prefetched") \
+    X(IN_WRITE_OK, "in_write_ok") \
+    X(IN_WRITE_ERROR, "in_write_error") \
+    X(IN_WRITE_DROPPED, "in_write_dropped") \
+    X(IN_MALFORMED, "in_malformed") \
+    X(IN_DUPLICATE, "in_duplicate") \
+    X(IN_REORDERED, "in_reordered") \
+    X(IN_REORDER_SKIPPED, "in_reorder_skipped") \
+    X(IN_LATE, "in_late") \
+    X(IN_RESYNC, "in_resync") \
+    X(IN_DECOMPRESS_ERROR, "in_decompress_error") \
+    X(IN_HEADERS_LOST, "in_headers_lost") \
+    X(IN_HEADERS_STALE, "in_headers_stale")
+
+/** Durations are recorded in nanoseconds and exported in seconds */
+#define TUNNEL_HISTOGRAMS(X) \
+    X(OUT_TUN_ENQUEUE, "out_tun_enqueue", "seconds", 1e-9) \
+    X(OUT_QUEUE_DELAY, "out_queue_delay", "seconds", 1e-9) \
+    X(OUT_COMPRESS, "out_compress", "seconds", 1e-9) \
+    X(OUT_ENCODE, "out_encode", "seconds", 1e-9) \
+    X(OUT_SEND_LATENCY, "out_send_latency", "seconds", 1e-9) \
+    X(OUT_MESSAGE_SIZE, "out_message_size", "bytes", 1.) \
+    X(IN_DECODE, "in_decode", "seconds", 1e-9) \
+    X(IN_DECOMPRESS, "in_decompress", "seconds", 1e-9) \
+    X(IN_TUN_WRITE, "in_tun_write", "seconds", 1e-9)
+
+#define TUNNEL_STATS_ENUM(id, name, ...) id,
+#define TUNNEL_STATS_NAME(id, name, ...) name,
+#define TUNNEL_STATS_UNIT(id, name, unit, scale) unit,
+#define TUNNEL_STATS_SCALE(id, name, unit, scale) scale,
+
+/** Counter IDs */
+enum Counter : size_t {
+    TUNNEL_COUNTERS(TUNNEL_STATS_ENUM)
+    COUNTER_COUNT
+};
+
+/** Histogram IDs */
+enum Histogram : size_t {
+    TUNNEL_HISTOGRAMS(TUNNEL_STATS_ENUM)
+    HISTOGRAM_COUNT
+};
+
+
+/**
+ * Counters and latency histograms updated from the data path without locks.
+ * Every thread adds to one of SHARDS cache line aligned slots with relaxed
+ * atomics; readers sum the slots, so a snapshot is not atomic as a whole.
+ * Histogram bucket i counts values in [2^(i-1), 2^i), bucket 0 counts 0.
+ */
+class Stats {
+public:
+    static constexpr size_t SHARDS = 8;
+    static constexpr size_t BUCKETS = 40;
+
+    static constexpr std::array<const char *, COUNTER_COUNT> COUNTER_NAMES = {TUNNEL_COUNTERS(TUNNEL_STATS_NAME)};
+    static constexpr std::array<const char *, HISTOGRAM_COUNT> HISTOGRAM_NAMES = {TUNNEL_HISTOGRAMS(TUNNEL_STATS_NAME)};
+    static constexpr std::array<const char *, HISTOGRAM_COUNT> HISTOGRAM_UNITS = {TUNNEL_HISTOGRAMS(TUNNEL_STATS_UNIT)};
+    /** Multiplier from recorded values to units */
+    static constexpr std::array<double, HISTOGRAM_COUNT> HISTOGRAM_SCALES = {TUNNEL_HISTOGRAMS(TUNNEL_STATS_SCALE)};
+
+    struct Snapshot {
+        std::array<uint64_t, COUNTER_COUNT> counters{};
+        std::array<std::array<uint64_t, BUCKETS>, HISTOGRAM_COUNT> histograms{};
+        std::array<uint64_t, HISTOGRAM_COUNT> sums{};
+
+        /**
+         * Upper bound of the bucket holding quantile q of histogram
+         */
+        uint64_t quantile(Histogram histogram, double q) const {
+            uint64_t total = 0;
+            for (auto n : histograms[histogram]) {
+                total += n;
+            }
+            if (!total) {
+                return 0;
+            }
+            auto rank = (uint64_t) (q * (double) (total - 1)) + 1;
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; i++) {
+                seen += histograms[histogram][i];
+                if (seen >= rank) {
+                    return i ? (uint64_t) 1 << i : 0;
+                }
+            }
+            return (uint64_t) 1 << (BUCKETS - 1);
+        }
+    };
+
+private:
+    struct alignas(64) Shard {
+        std::array<std::atomic<uint64_t>, COUNTER_COUNT> counters{};
+        std::array<std::array<std::atomic<uint64_t>, BUCKETS>, HISTOGRAM_COUNT> histograms{};
+        std::array<std::atomic<uint64_t>, HISTOGRAM_COUNT> sums{};
+    };
+
+    std::array<Shard, SHARDS> _shards{};
+
+public:
+    void add(Counter counter, uint64_t n = 1) {
+        _shard().counters[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void record(Histogram histogram, uint64_t value) {
+        auto & shard = _shard();
+        shard.histograms[histogram][_bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        shard.sums[histogram].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    template <typename Rep, typename Period>
+    void record(Histogram histogram, std::chrono::duration<Rep, Period> duration) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+        record(histogram, ns > 0 ? (uint64_t) ns : 0);
+    }
+
+    uint64_t get(Counter counter) const {
+        uint64_t value = 0;
+        for (const auto & shard : _shards) {
+            value += shard.counters[counter].load(std::memory_order_relaxed);
+        }
+        return value;
+    }
+
+    Snapshot snapshot() const {
+        Snapshot snapshot;
+        for (const auto & shard : _shards) {
+            for (size_t i = 0; i < COUNTER_COUNT; i++) {
+                snapshot.counters[i] += shard.counters[i].load(std::memory_order_relaxed);
+            }
+            for (size_t h = 0; h < HISTOGRAM_COUNT; h++) {
+                for (size_t i = 0; i < BUCKETS; i++) {
+                    snapshot.histograms[h][i] += shard.histograms[h][i].load(std::memory_order_relaxed);
+                }
+                snapshot.sums[h] += shard.sums[h].load(std::memory_order_relaxed);
+            }
+        }
+        return snapshot;
+    }
+
+private:
+    static size_t _bucket(uint64_t value) {
+        size_t bucket = value ? 64 - (size_t) __builtin_clzll(value) : 0;
+        return bucket < BUCKETS ? bucket : BUCKETS - 1;
+    }
+
+    Shard & _shard() {
+        static std::atomic<size_t> next_thread{0};
+        thread_local size_t index = next_thread.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+        return _shards[index];
+    }
+};
+
+#undef TUNNEL_STATS_ENUM
+#undef TUNNEL_STATS_NAME
+#undef TUNNEL_STATS_UNIT
+#undef TUNNEL_STATS_SCALE
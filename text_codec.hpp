@@ -0,0 +1,76 @@
+#pragma once
+
+#include <climits>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include "base32768.hpp"
+#include "base91x.hpp"
+
+
+/**
+ * Binary-to-text codecs usable for tunnel messages.
+ * Lengths are in characters as Telegram counts them (UTF-16 code units),
+ * sizes are in bytes of UTF-8 text.
+ */
+class TextCodec {
+public:
+    enum Type {
+        BASE91X,
+        BASE32768,
+    };
+
+    static Type parse(std::string_view name) {
+        if (name == "base91x") {
+            return BASE91X;
+        }
+        if (name == "base32768") {
+            return BASE32768;
+        }
+        throw std::runtime_error("Unknown codec: " + std::string(name));
+    }
+
+    static const char * name(Type type) {
+        return type == BASE32768 ? "base32768" : "base91x";
+    }
+
+    static size_t encodedLength(Type type, size_t size) {
+        return type == BASE32768 ? base32768::compute_encoded_length(size) : base91x::compute_encoded_size(size);
+    }
+
+    /**
+     * Largest data size whose encoding is at most length characters long
+     */
+    static size_t maxDataSize(Type type, size_t length) {
+        return type == BASE32768
+            ? length * base32768::word_bit / CHAR_BIT
+            : length * base91x::b91word_bit / (2 * CHAR_BIT);
+    }
+
+    static size_t encodedSize(Type type, size_t size) {
+        return type == BASE32768 ? base32768::compute_encoded_size(size) : base91x::compute_encoded_size(size);
+    }
+
+    static size_t maxDecodedSize(Type type, size_t text_size) {
+        return type == BASE32768 ? base32768::assume_decoded_size(text_size) : base91x::assume_decoded_size(text_size);
+    }
+
+    static size_t encode(Type type, const void * data, size_t size, char * text) {
+        return type == BASE32768 ? base32768::encode(data, size, text) : base91x::encode(data, size, text);
+    }
+
+    static size_t decode(Type type, const char * text, size_t size, void * data) {
+        return type == BASE32768 ? base32768::decode(text, size, data) : base91x::decode(text, size, data);
+    }
+
+    static void encode(Type type, std::string_view data, std::string & text) {
+        text.resize(encodedSize(type, data.size()));
+        text.resize(encode(type, data.data(), data.size(), text.data()));
+    }
+
+    static void decode(Type type, std::string_view text, std::string & data) {
+        data.resize(maxDecodedSize(type, text.size()));
+        data.resize(decode(type, text.data(), text.size(), data.data()));
+    }
+};
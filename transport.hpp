@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+
+/**
+ * Outcome of a single sendTextMessage() call, as reported by the transport.
+ */
+struct SendResult {
+    bool ok{false};
+    /** Transport specific error code, e.g. 429 for Telegram's FLOOD_WAIT */
+    std::int32_t error_code{0};
+    std::string error_message;
+    /** Identifier of the sent message, 0 if unknown */
+    std::int64_t message_id{0};
+};
+
+/**
+ * Text message or document delivered by the transport.
+ * The text and document are only valid for the duration of the message handler call.
+ */
+struct ReceivedMessage {
+    std::int64_t chat_id{0};
+    std::int64_t sender_id{0};
+    std::int64_t message_id{0};
+    /** Text of a message or caption of a document */
+    std::string_view text;
+    /** Content of a document, empty for a text message */
+    std::string_view document;
+};
+
+/**
+ * Carrier of text messages and binary documents between two tunnel peers.
+ * Implemented by TdClient (Telegram via TDLib) and LoopbackTransport (in-process).
+ *
+ * Send handlers and the message handler are called from the transport's own
+ * thread and must not block.
+ */
+class Transport {
+public:
+    using SendHandler = std::function<void(const SendResult &)>;
+    using MessageHandler = std::function<void(const ReceivedMessage &)>;
+
+    virtual ~Transport() = default;
+
+    virtual void sendTextMessage(std::int64_t chat_id, std::string text, SendHandler handler) = 0;
+
+    virtual bool supportsDocuments() const {
+        return false;
+    }
+
+    /**
+     * Send data as a binary document with a text caption
+     */
+    virtual void sendDocument(std::int64_t /* chat_id */, std::string /* caption */, std::string /* data */, SendHandler handler) {
+        if (handler) {
+            SendResult result;
+            result.error_code = 400;
+            result.error_message = "Documents are not supported";
+            handler(result);
+        }
+    }
+
+    void setMessageHandler(MessageHandler handler) {
+        _message_handler = std::move(handler);
+    }
+
+protected:
+    void _deliverMessage(const ReceivedMessage & message) {
+        if (_message_handler) {
+            _message_handler(message);
+        }
+    }
+
+private:
+    MessageHandler _message_handler;
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <tuntap++.hh>
+#include "config.hpp"
+#include "packet_device.hpp"
+#include "utils.hpp"
+
+
+/**
+ * Kernel TUN device configured from TUNConfig.
+ *
+ * With tun.queues above 1 the device is created with IFF_MULTI_QUEUE, which
+ * libtuntap does not support, so its queues are opened and the device is
+ * configured with ioctl() here. The kernel steers each flow to one queue.
+ */
+class TunDevice {
+    /** One queue of the device, owns its file descriptor unless libtuntap does */
+    class Queue : public FdPacketDevice {
+        bool _owned;
+
+    public:
+        Queue(int fd, bool owned) : _owned(owned) {
+            _fd = fd;
+        }
+
+        ~Queue() override {
+            if (_owned) {
+                ::close(_fd);
+            }
+        }
+
+        Queue(const Queue &) = delete;
+        Queue & operator=(const Queue &) = delete;
+    };
+
+    tuntap::tun _tun;
+    std::vector<std::unique_ptr<Queue>> _queues;
+
+public:
+    explicit TunDevice(const TUNConfig & config) {
+        if (config.queues <= 1) {
+            _tun.name(config.name);
+            _tun.mtu(config.mtu);
+            _tun.up();
+            _tun.ip(config.ip, 24);
+            _tun.nonblocking(true);
+            _queues.push_back(std::make_unique<Queue>(_tun.native_handle(), false));
+            println("TUN device {} is up", config.name);
+            return;
+        }
+
+        for (size_t i = 0; i < config.queues; i++) {
+            _queues.push_back(std::make_unique<Queue>(_openQueue(config.name), true));
+        }
+        _configure(config);
+        println("TUN device {} is up with {} queues", config.name, config.queues);
+    }
+
+    TunDevice(const TunDevice &) = delete;
+    TunDevice & operator=(const TunDevice &) = delete;
+
+    /**
+     * Every queue of the device, valid as long as it is
+     */
+    std::vector<PacketDevice *> queues() const {
+        std::vector<PacketDevice *> queues;
+        for (const auto & queue : _queues) {
+            queues.push_back(queue.get());
+        }
+        return queues;
+    }
+
+private:
+    static int _openQueue(const std::string & name) {
+        int fd = ::open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error(std::string("Failed to open /dev/net/tun: ") + std::strerror(errno));
+        }
+        ifreq request{};
+        request.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE;
+        std::strncpy(request.ifr_name, name.c_str(), IFNAMSIZ - 1);
+        if (ioctl(fd, TUNSETIFF, &request) < 0) {
+            auto error = errno;
+            ::close(fd);
+            throw std::runtime_error("Failed to attach queue to TUN device " + name + ": " + std::strerror(error));
+        }
+        return fd;
+    }
+
+    /**
+     * Set MTU, address with a /24 netmask and bring the device up, like libtuntap does
+     */
+    static void _configure(const TUNConfig & config) {
+        int fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error(std::string("Failed to open socket: ") + std::strerror(errno));
+        }
+        auto check = [fd, &config](int result, const char * what) {
+            if (result < 0) {
+                auto error = errno;
+                ::close(fd);
+                throw std::runtime_error("Failed to set " + std::string(what) + " of TUN device " + config.name + ": " + std::strerror(error));
+            }
+        };
+        ifreq request{};
+        std::strncpy(request.ifr_name, config.name.c_str(), IFNAMSIZ - 1);
+
+        request.ifr_mtu = config.mtu;
+        check(ioctl(fd, SIOCSIFMTU, &request), "MTU");
+
+        auto address = reinterpret_cast<sockaddr_in *>(&request.ifr_addr);
+        address->sin_family = AF_INET;
+        check(inet_pton(AF_INET, config.ip.c_str(), &address->sin_addr) == 1 ? 0 : (errno = EINVAL, -1), "address");
+        check(ioctl(fd, SIOCSIFADDR, &request), "address");
+        auto netmask = reinterpret_cast<sockaddr_in *>(&request.ifr_netmask);
+        netmask->sin_family = AF_INET;
+        netmask->sin_addr.s_addr = htonl(0xFFFFFF00);
+        check(ioctl(fd, SIOCSIFNETMASK, &request), "netmask");
+
+        check(ioctl(fd, SIOCGIFFLAGS, &request), "flags");
+        request.ifr_flags |= IFF_UP | IFF_RUNNING;
+        check(ioctl(fd, SIOCSIFFLAGS, &request), "flags");
+        ::close(fd);
+    }
+};
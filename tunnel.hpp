@@ -0,0 +1,1440 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <boost/circular_buffer.hpp>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "ack_filter.hpp"
+#include "buffer_pool.hpp"
+#include "compressor.hpp"
+#include "config.hpp"
+#include "dns_cache.hpp"
+#include "flow_queue.hpp"
+#include "flush_scheduler.hpp"
+#include "header_compressor.hpp"
+#include "metrics_server.hpp"
+#include "packer.hpp"
+#include "packet_device.hpp"
+#include "process_usage.hpp"
+#include "reorder_buffer.hpp"
+#include "send_governor.hpp"
+#include "stats.hpp"
+#include "text_codec.hpp"
+#include "transport.hpp"
+#include "utils.hpp"
+
+
+/**
+ * TUN/batching pipeline: reads IP packets from the PacketDevice, batches them
+ * into text messages sent over a Transport, and writes packets received from
+ * the Transport back to the PacketDevice.
+ *
+ * Messages are striped across send lanes, one per configured account and
+ * chat, each one rate limited on its own. Every message goes to the lane that
+ * may send first, so lanes get a share of traffic matching their rate.
+ * Messages received on all lanes are merged into one stream of packets.
+ *
+ * Every message carries a sequence number, so the receiver puts messages
+ * back in order and drops duplicates before writing their packets.
+ *
+ * Once the backlog reaches document_min_bytes, batches of up to
+ * DOCUMENT_CAPACITY bytes are sent as binary documents instead, which carry
+ * far more per API call than text, if every lane's transport supports them.
+ *
+ * Messages failed with a transient error are sent again ahead of new ones,
+ * on any lane, until their packets are stale: pure TCP ACKs soon, as later
+ * ones supersede them, and other packets after retransmit_deadline_ms.
+ *
+ * The device may have several queues, as a multiqueue TUN device does. Every
+ * queue is read by a thread of its own, and with more than one queue received
+ * packets are written by a thread per queue, picked by flow hash, so the
+ * kernel's processing of both directions runs on as many cores. Packets meet
+ * in one cache and one message stream, as sequence numbers and header
+ * compression contexts are shared with the peer.
+ */
+class Tunnel {
+public:
+    const std::string MESSAGE_HEADER_TEXT_SINGLE = "#iotts ";
+    const std::string MESSAGE_HEADER_TEXT_MULTIPLE = "#iottm ";
+    const std::string MESSAGE_HEADER_UNICODE_SINGLE = "#iotus ";
+    const std::string MESSAGE_HEADER_UNICODE_MULTIPLE = "#iotum ";
+    /** Caption of documents, their codec letter is that of text messages but unused */
+    const std::string MESSAGE_HEADER_TEXT_DOCUMENT = "#iottd ";
+    const std::string MESSAGE_HEADER_UNICODE_DOCUMENT = "#iotud ";
+    /** Flags messages whose data starts with a big-endian uint32 sequence number */
+    const char SEQUENCE_TAG = 'n';
+    const size_t SEQUENCE_SIZE = sizeof(uint32_t);
+    const size_t MESSAGE_MAX_SIZE = 4096;
+    /** Payload bytes packed into one document at most */
+    const size_t DOCUMENT_CAPACITY = 1 << 20;
+    const size_t IPV4_PACKET_HEADER_MAX_SIZE = 60;
+    const size_t IPV4_PACKET_HEADER_MIN_SIZE = 20;
+    /** Packets of the fattest flow are dropped once more than this many messages are waiting in cache */
+    const size_t CACHE_MAX_MESSAGES = 8;
+    /** Packets read from TUN per wakeup at most */
+    const size_t TUN_READ_BATCH_MAX = 64;
+    /** Received packets waiting for the writer of a queue at most, later ones are dropped */
+    const size_t TUN_WRITE_QUEUE_MAX = 4096;
+    /** Batches are packed up to this many times the message capacity while compression pays off */
+    const double COMPRESSION_RATIO_MAX = 4;
+    /** Failed messages waiting to be sent again at most, the oldest one is dropped first */
+    const size_t RETRANSMIT_MAX_MESSAGES = 16;
+    /** Sent messages awaiting their result at most, a newer one takes the slot of the oldest */
+    const size_t UNACKED_MAX_MESSAGES = 256;
+    const unsigned RETRANSMIT_MAX_ATTEMPTS = 4;
+    /** Pure TCP ACKs are not sent again after this */
+    const std::chrono::milliseconds RETRANSMIT_ACK_DEADLINE{500};
+
+    struct Lane {
+        Transport & transport;
+        std::int64_t send_to_chat_id;
+        std::int64_t receive_from_user_id;
+    };
+
+    enum Kind {
+        /** Text message of one packet */
+        SINGLE,
+        /** Text message of a batch */
+        MULTIPLE,
+        /** Document of a batch */
+        DOCUMENT,
+    };
+
+private:
+    Config _config;
+    std::vector<Lane> _lanes;
+    /** Lane scanned first for the next message, used by the sending thread only */
+    size_t _next_lane{0};
+    TextCodec::Type _codec;
+    Compressor _compressor;
+    /** Headers of single packet, batched and batched uncompressed messages, flag codec and compression */
+    std::string _single_header;
+    std::string _multiple_header;
+    std::string _uncompressed_header;
+    /** Captions of compressed and uncompressed documents */
+    std::string _document_header;
+    std::string _uncompressed_document_header;
+    /** Whether every lane's transport supports documents and they are enabled */
+    bool _documents;
+    /** Payload bytes that fit into one message */
+    size_t _message_capacity;
+    MessagePacker _packer;
+    MessageUnpacker _unpacker;
+    HeaderCompressor _header_compressor;
+    HeaderDecompressor _header_decompressor;
+
+    std::atomic<bool> _running{false};
+    /** Wakes up TUN threads blocked in poll() on stop */
+    int _wakeup_fd{-1};
+    std::thread _cache_flush_thread;
+    std::thread stats_thread_;
+
+    Stats _stats;
+    std::chrono::steady_clock::time_point _created{std::chrono::steady_clock::now()};
+    /** Time from _created to the first packet written to TUN, in steady_clock ticks, 0 if none was yet */
+    std::atomic<std::chrono::steady_clock::rep> _first_packet{0};
+
+    struct CachedPacket {
+        PacketPool::Buffer data;
+        FlushScheduler::clock::time_point time;
+    };
+
+    PacketPool _pool;
+
+    /** Queue of the device with its threads */
+    struct Queue {
+        PacketDevice & device;
+        std::thread reader;
+        /** Packets drained on one wakeup, used by the reader only */
+        std::vector<CachedPacket> read_batch;
+        /** Response to a DNS query, used by the reader only */
+        std::string dns_response;
+
+        /** Writes packets received for flows of this queue, if there is more than one queue */
+        std::thread writer;
+        std::mutex write_mutex;
+        std::condition_variable write_cv;
+        /** Guarded by write_mutex */
+        std::vector<PacketPool::Buffer> writes;
+        /** Packets of a received message for this queue, used by the receiving thread only */
+        std::vector<PacketPool::Buffer> pending;
+
+        explicit Queue(PacketDevice & device) : device(device) {}
+    };
+
+    std::vector<std::unique_ptr<Queue>> _queues;
+    /** Serializes readers of several queues, which send themselves without cache */
+    std::mutex _send_mutex;
+    /** Answers repeated DNS queries without the tunnel, if enabled */
+    std::unique_ptr<DnsCache> _dns;
+
+    std::mutex cache_mutex;
+    std::condition_variable cache_cv;
+    FlowQueue<CachedPacket> cache;
+    /** Used by the flush thread only */
+    AckFilter _ack_filter;
+    /** Bytes of cached packets with frame headers */
+    size_t cache_bytes{0};
+    /** Bytes of cached packets that fill one message after compression */
+    size_t _batch_capacity;
+
+    SendGovernor _governor;
+    FlushScheduler _scheduler;
+    /** Read time of the oldest packet held by _packer */
+    FlushScheduler::clock::time_point _packed_since;
+    /** Latest deadline of packets held by _packer, and of the last packed one */
+    SendGovernor::clock::time_point _packed_deadline;
+    SendGovernor::clock::time_point _packet_deadline;
+
+    /** Message to send again if it fails */
+    struct Retransmit {
+        /** Text of a message or caption of a document, empty to never send it again */
+        std::string text;
+        /** Content of a document, empty for a text message */
+        std::string document;
+        SendGovernor::clock::time_point deadline;
+        unsigned attempts{0};
+    };
+
+    /** Failed messages, guarded by cache_mutex */
+    boost::circular_buffer<Retransmit> _retransmits;
+
+    /** Sent message awaiting its result */
+    struct Unacked {
+        /** Send ID, 0 if the slot is free */
+        uint32_t id{0};
+        SendGovernor::clock::time_point sent;
+        Retransmit retransmit;
+    };
+
+    /**
+     * Sent messages by send ID % UNACKED_MAX_MESSAGES, so their handlers capture
+     * the ID only and slots keep their buffers. Guarded by _unacked_mutex
+     */
+    std::vector<Unacked> _unacked;
+    std::mutex _unacked_mutex;
+    /** ID of the last sent message, used by the sending thread only */
+    uint32_t _send_id{0};
+
+    /** Payload bytes per sent byte of recent batches, used by the sending thread only */
+    double _compression_ratio{1};
+    /** Frame bytes of recent packets per packed byte after header compression, used by the sending thread only */
+    double _header_ratio{1};
+
+    /** Sequence number of the next message, used by the sending thread only */
+    uint32_t _send_sequence;
+
+    /** Scratch of compressed packet, payload, sequenced data and message text being sent, used by the sending thread only */
+    std::string _compressed_packet;
+    std::string _compressed;
+    std::string _sequenced;
+    std::string _send_text;
+    /** Scratch of decoded and decompressed payload and packets sliced from it, used by the receiving thread only */
+    std::string _receive_data;
+    std::string _decompressed;
+    std::vector<std::string_view> _write_batch;
+    struct ReceivedPayload {
+        Kind kind{SINGLE};
+        Compressor::Type compression{Compressor::NONE};
+        std::string data;
+    };
+
+    /** Lanes may deliver messages from different threads, guards the receiving side */
+    std::mutex _receive_mutex;
+    ReorderBuffer<ReceivedPayload> _reorder;
+    /** Wakes up the reorder thread once a message is stored */
+    std::condition_variable _reorder_cv;
+    std::thread _reorder_thread;
+
+public:
+    /**
+     * @param queues - queues of the device, at least one
+     * @param transports - transport of every lane in config.lanes, lanes may share one
+     */
+    Tunnel(const Config & config, const std::vector<PacketDevice *> & queues, const std::vector<Transport *> & transports) : _config(config),
+        _lanes(_makeLanes(config, transports)),
+        _codec(TextCodec::parse(config.codec)),
+        _compressor(Compressor::parse(config.compression)),
+        _single_header(_makeHeader(_codec, SINGLE, Compressor::NONE)),
+        _multiple_header(_makeHeader(_codec, MULTIPLE, _compressor.type())),
+        _uncompressed_header(_makeHeader(_codec, MULTIPLE, Compressor::NONE)),
+        _document_header(_makeHeader(_codec, DOCUMENT, _compressor.type())),
+        _uncompressed_document_header(_makeHeader(_codec, DOCUMENT, Compressor::NONE)),
+        _documents(config.document_min_bytes > 0 && std::all_of(transports.begin(), transports.end(),
+            [](Transport * transport) { return transport->supportsDocuments(); })),
+        _message_capacity(TextCodec::maxDataSize(_codec, MESSAGE_MAX_SIZE - _multiple_header.size()) - SEQUENCE_SIZE),
+        _packer(_message_capacity),
+        _pool(config.tun.mtu + IPV4_PACKET_HEADER_MAX_SIZE, 4 * TUN_READ_BATCH_MAX),
+        _batch_capacity(_message_capacity),
+        _governor(config.max_messages_per_second),
+        _scheduler(_flushLatency(config), config.flush_min_fill, _governor, _laneIds()),
+        _retransmits(RETRANSMIT_MAX_MESSAGES),
+        _unacked(UNACKED_MAX_MESSAGES),
+        _send_sequence(std::random_device{}()),
+        _reorder(std::chrono::duration_cast<ReorderBuffer<ReceivedPayload>::clock::duration>(
+            std::chrono::duration<float, std::milli>(config.reorder_timeout_ms)))
+    {
+        if (queues.empty()) {
+            throw std::invalid_argument("Tunnel needs at least one device queue");
+        }
+        for (auto device : queues) {
+            _queues.push_back(std::make_unique<Queue>(*device));
+            _queues.back()->read_batch.reserve(TUN_READ_BATCH_MAX);
+        }
+        _send_text.reserve(MESSAGE_MAX_SIZE * 3);
+        _receive_data.reserve(_message_capacity);
+        _write_batch.reserve(_receiveMaxSize() / MessagePacker::frameSize(IPV4_PACKET_HEADER_MIN_SIZE));
+        if (config.dns_cache_size > 0) {
+            _dns = std::make_unique<DnsCache>(config.dns_cache_size, config.dns_prefetch);
+        }
+
+        _wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (_wakeup_fd < 0) {
+            throw std::runtime_error(std::string("eventfd failed: ") + std::strerror(errno));
+        }
+
+        for (auto & lane : _lanes) {
+            lane.transport.setMessageHandler([this, transport = &lane.transport](const ReceivedMessage & message) {
+                _onMessage(*transport, message);
+            });
+        }
+    }
+
+    Tunnel(const Config & config, PacketDevice & tun, const std::vector<Transport *> & transports)
+        : Tunnel(config, std::vector<PacketDevice *>{&tun}, transports) {}
+
+    ~Tunnel() {
+        stop();
+        for (auto & lane : _lanes) {
+            lane.transport.setMessageHandler({});
+        }
+        ::close(_wakeup_fd);
+    }
+
+    std::atomic<bool> _listen{true};
+
+    void count(Counter counter, size_t n = 1) {
+        _stats.add(counter, n);
+    }
+
+    const Stats & stats() const {
+        return _stats;
+    }
+
+    /**
+     * Stats in the Prometheus text format
+     */
+    std::string metrics() const {
+        return formatMetrics(_stats.snapshot(), _message_capacity, ProcessUsage::current(), firstPacketSeconds());
+    }
+
+    /**
+     * Time from construction to the first packet written to TUN, 0 if none was yet
+     */
+    double firstPacketSeconds() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::duration(_first_packet.load())).count();
+    }
+
+    /**
+     * Handle the result of the message of send ID id sent on lane
+     */
+    void _onSendResult(uint32_t id, size_t lane, const SendResult & result) {
+        auto now = SendGovernor::clock::now();
+        count(result.ok ? OUT_SEND_OK : OUT_SEND_ERROR);
+        Retransmit retransmit;
+        bool known;
+        SendGovernor::clock::time_point sent;
+        {
+            std::scoped_lock lock(_unacked_mutex);
+            auto & unacked = _unacked[id % UNACKED_MAX_MESSAGES];
+            known = unacked.id == id;
+            if (known) {
+                unacked.id = 0;
+                sent = unacked.sent;
+                if (!result.ok) {
+                    retransmit = std::move(unacked.retransmit);
+                }
+                // Documents are few and large, their buffer is not worth keeping
+                std::string().swap(unacked.retransmit.document);
+            }
+        }
+        if (!result.ok) {
+            // The peer misses header compression context updates of a message late or lost
+            _header_compressor.invalidate();
+            if (known) {
+                _onSendFailed(result, std::move(retransmit), now);
+            } else if (_config.retransmit_deadline_ms > 0) {
+                // Its slot was taken by a newer message
+                count(OUT_RETRANSMIT_DROPPED);
+            }
+        }
+        if (known) {
+            _stats.record(OUT_SEND_LATENCY, now - sent);
+        }
+        if (_governor.onResult((std::int64_t) lane, result, now)) {
+            count(OUT_FLOOD_WAIT);
+        }
+    }
+
+    void start() {
+        if (_running) {
+            return;
+        }
+        _running = true;
+        uint64_t wakeups;
+        while (::read(_wakeup_fd, &wakeups, sizeof(wakeups)) > 0) {}
+
+        for (size_t i = 0; i < _queues.size(); i++) {
+            _queues[i]->reader = std::thread([this, i, &queue = *_queues[i]]() {
+                println("Begin to listen for TUN device queue {}", i);
+                while (_running) {
+                    if (!_listen) {
+                        _waitWakeup(100);
+                        continue;
+                    }
+
+                    // Backpressure: leave packets queued in the kernel while sending is throttled.
+                    // Cached packets are always read, so they can be queued fairly, see below
+                    if (_config.cache_flush_rate <= 0) {
+                        std::unique_lock send_lock(_send_mutex);
+                        auto now = SendGovernor::clock::now();
+                        SendGovernor::clock::time_point send_time;
+                        _nextLane(now, send_time);
+                        if (send_time > now) {
+                            send_lock.unlock();
+                            count(OUT_BACKPRESSURE);
+                            std::this_thread::sleep_until(std::min(send_time, now + std::chrono::milliseconds(100)));
+                            continue;
+                        }
+                        Retransmit retransmit;
+                        bool resend;
+                        {
+                            std::scoped_lock lock(cache_mutex);
+                            resend = _takeRetransmit(now, retransmit);
+                        }
+                        if (resend) {
+                            _resend(std::move(retransmit));
+                            continue;
+                        }
+                    }
+
+                    if (!_waitTun(queue.device)) {
+                        continue;
+                    }
+
+                    // Drain every ready packet
+                    auto & packets = queue.read_batch;
+                    packets.clear();
+                    auto now = FlushScheduler::clock::now();
+                    while (packets.size() < TUN_READ_BATCH_MAX) {
+                        auto packet = _pool.acquire();
+                        auto len = queue.device.read(packet.data(), packet.capacity());
+                        if (len < 0) {
+                            println("Error while reading from TUN device: {}", len);
+                            count(OUT_TUN_READ_ERROR);
+                            break;
+                        }
+                        if (len == 0) {
+                            break;
+                        }
+                        packet.resize(len);
+                        packets.push_back({std::move(packet), now});
+                    }
+                    if (packets.empty()) {
+                        continue;
+                    }
+                    count(OUT_TUN_READ_OK, packets.size());
+                    if (_dns) {
+                        _answerDns(queue);
+                        if (packets.empty()) {
+                            continue;
+                        }
+                    }
+
+                    if (_config.cache_flush_rate > 0) {
+                        {
+                            std::scoped_lock lock(cache_mutex);
+                            for (auto & packet : packets) {
+                                cache_bytes += MessagePacker::frameSize(packet.data.size());
+                                cache.push(std::move(packet));
+                            }
+                            count(OUT_CACHE_PRIORITIZED, std::exchange(cache.prioritized, 0));
+                            // Rather than leave interactive packets behind a bulk transfer in the
+                            // kernel's queue, drop from the flow that caused the backlog
+                            while (cache_bytes > _cacheLimit()) {
+                                auto dropped = cache.dropFattest();
+                                cache_bytes -= MessagePacker::frameSize(dropped.data.size());
+                                count(OUT_CACHE_DROPPED);
+                            }
+                        }
+                        cache_cv.notify_one();
+                        count(OUT_CACHE_INSERTED, packets.size());
+                        auto enqueued = FlushScheduler::clock::now();
+                        for (auto & packet : packets) {
+                            _stats.record(OUT_TUN_ENQUEUE, enqueued - packet.time);
+                        }
+                        continue;
+                    }
+
+                    std::scoped_lock send_lock(_send_mutex);
+                    for (const auto & [packet, time] : packets) {
+                        _setPacketDeadline(packet, time);
+                        if (TextCodec::encodedLength(_codec, SEQUENCE_SIZE + packet.size()) + _singleHeader().size() > MESSAGE_MAX_SIZE) {
+                            _packer.add(packet, [this](std::string_view payload) { _sendPayload(payload); });
+                            _packer.flush([this](std::string_view payload) { _sendPayload(payload); });
+                        } else {
+                            _sendText(_singleHeader(), packet);
+                        }
+                    }
+                }
+                println("Ended to listen for TUN device queue {}", i);
+            });
+        }
+
+        if (_queues.size() > 1) {
+            for (auto & queue : _queues) {
+                queue->writer = std::thread([this, &queue = *queue]() {
+                    std::vector<PacketPool::Buffer> writes;
+                    std::vector<std::string_view> packets;
+                    while (true) {
+                        {
+                            std::unique_lock lock(queue.write_mutex);
+                            queue.write_cv.wait(lock, [this, &queue]() { return !queue.writes.empty() || !_running; });
+                            if (queue.writes.empty()) {
+                                break;
+                            }
+                            writes.swap(queue.writes);
+                        }
+                        packets.assign(writes.begin(), writes.end());
+                        _writeToDevice(queue.device, packets.data(), packets.size());
+                        writes.clear();
+                    }
+                });
+            }
+        }
+
+        if (_config.cache_flush_rate > 0) {
+            _cache_flush_thread = std::thread([this]() {
+                println("Begin to flush cache");
+                std::vector<CachedPacket> packets;
+                packets.reserve(TUN_READ_BATCH_MAX);
+                while (_running) {
+                    packets.clear();
+                    Retransmit retransmit;
+                    bool resend = false;
+                    {
+                        std::unique_lock lock(cache_mutex);
+                        // Cached packets are counted before header compression, so are the packed ones
+                        auto packed = (size_t) ((double) _packer.size() * _header_ratio);
+                        bool document = _documents && packed + cache_bytes >= _config.document_min_bytes;
+                        if (document) {
+                            _packer.setCapacity(DOCUMENT_CAPACITY);
+                        } else if (_compressor.type() != Compressor::NONE) {
+                            _packer.setCapacity((size_t) ((double) _message_capacity * _compression_ratio));
+                        } else {
+                            _packer.setCapacity(_message_capacity);
+                        }
+                        _batch_capacity = (size_t) ((double) _packer.capacity() * _header_ratio);
+                        auto now = FlushScheduler::clock::now();
+                        if (!_listen || (cache.empty() && _packer.empty() && _retransmits.empty())) {
+                            cache_cv.wait_for(lock, std::chrono::milliseconds(100));
+                            continue;
+                        }
+
+                        if (!_retransmits.empty()) {
+                            // Failed messages go first, as soon as a lane may send
+                            SendGovernor::clock::time_point send_time;
+                            _nextLane(now, send_time);
+                            if (send_time > now) {
+                                cache_cv.wait_until(lock, send_time);
+                                continue;
+                            }
+                            resend = _takeRetransmit(now, retransmit);
+                        }
+
+                        if (!resend) {
+                            if (cache.empty() && _packer.empty()) {
+                                continue;
+                            }
+                            auto oldest = _packer.empty() ? cache.oldest() : _packed_since;
+                            // A backlog worth a document is as good as a full message
+                            auto fill = document ? std::min<size_t>(_batch_capacity, _config.document_min_bytes) : _batch_capacity;
+                            auto send_time = _scheduler.sendTime(packed + cache_bytes, fill, oldest, now);
+                            if (send_time > now) {
+                                cache_cv.wait_until(lock, send_time);
+                                continue;
+                            }
+
+                            // Take packets enough to fill one message, the remainder stays in _packer.
+                            // ACKs superseded by later ones leave room for more packets
+                            size_t taken = packed;
+                            while (!cache.empty() && taken < _batch_capacity) {
+                                while (!cache.empty() && taken < _batch_capacity) {
+                                    packets.push_back(cache.pop());
+                                    taken += MessagePacker::frameSize(packets.back().data.size());
+                                    cache_bytes -= MessagePacker::frameSize(packets.back().data.size());
+                                }
+                                if (_config.ack_thinning) {
+                                    _ack_filter.thin(packets, [this, &taken](const CachedPacket & packet) {
+                                        taken -= MessagePacker::frameSize(packet.data.size());
+                                        count(OUT_ACKS_THINNED);
+                                        count(OUT_ACKS_THINNED_BYTES, packet.data.size());
+                                    });
+                                }
+                            }
+                        }
+                    }
+                    if (resend) {
+                        _resend(std::move(retransmit));
+                        continue;
+                    }
+
+                    size_t sent = 0;
+                    auto send = [this, &sent](std::string_view payload) {
+                        _sendPayload(payload);
+                        sent++;
+                    };
+                    auto now = FlushScheduler::clock::now();
+                    for (auto & packet : packets) {
+                        _stats.record(OUT_QUEUE_DELAY, now - packet.time);
+                        bool was_empty = _packer.empty();
+                        auto before = sent;
+                        _setPacketDeadline(packet.data, packet.time);
+                        _pack(packet.data, send);
+                        if (was_empty || sent != before) {
+                            _packed_since = packet.time;
+                        }
+                    }
+                    if (!sent) {
+                        // Due by latency, fill or idle link rather than by a full message
+                        _packer.flush(send);
+                    }
+                    count(OUT_CACHE_FLUSHED, packets.size());
+                }
+                println("Ended to flush cache");
+            });
+        }
+
+        _reorder_thread = std::thread([this]() {
+            std::unique_lock lock(_receive_mutex);
+            while (_running) {
+                auto deadline = _reorder.deadline();
+                if (deadline == ReorderBuffer<ReceivedPayload>::clock::time_point::max()) {
+                    _reorder_cv.wait_for(lock, std::chrono::milliseconds(100));
+                } else {
+                    _reorder_cv.wait_until(lock, deadline);
+                }
+                _reorder.expire(ReorderBuffer<ReceivedPayload>::clock::now(), [this](ReceivedPayload & payload) {
+                    _receiveStored(payload);
+                });
+                _countReorder();
+            }
+        });
+
+        stats_thread_ = std::thread([this]() {
+            while (_running) {
+                _waitWakeup(5000);
+                if (!_running || !_listen) {
+                    continue;
+                }
+
+                auto snapshot = _stats.snapshot();
+                print("Stats: ");
+                for (size_t i = 0; i < COUNTER_COUNT; i++) {
+                    if (snapshot.counters[i]) {
+                        print("{}: {}, ", Stats::COUNTER_NAMES[i], snapshot.counters[i]);
+                    }
+                }
+                for (size_t i = 0; i < HISTOGRAM_COUNT; i++) {
+                    auto histogram = (Histogram) i;
+                    if (snapshot.sums[i]) {
+                        print("{}_{}: p50 {:g} p99 {:g}, ", Stats::HISTOGRAM_NAMES[i], Stats::HISTOGRAM_UNITS[i],
+                            (double) snapshot.quantile(histogram, 0.5) * Stats::HISTOGRAM_SCALES[i],
+                            (double) snapshot.quantile(histogram, 0.99) * Stats::HISTOGRAM_SCALES[i]);
+                    }
+                }
+                auto usage = ProcessUsage::current();
+                auto packets = snapshot.counters[OUT_TUN_READ_OK] + snapshot.counters[IN_WRITE_OK];
+                println("resident_memory: {} MiB, disk_write_bytes_per_packet: {:.1f}",
+                    usage.resident_bytes >> 20, packets ? (double) usage.disk_write_bytes / (double) packets : 0.);
+            }
+        });
+    }
+
+    void stop() {
+        if (!_running) {
+            return;
+        }
+        _running = false;
+        uint64_t wakeup = 1;
+        if (::write(_wakeup_fd, &wakeup, sizeof(wakeup)) < 0) {
+            println(stderr, "Failed to wake up TUN thread: {}", std::strerror(errno));
+        }
+        cache_cv.notify_all();
+        {
+            std::scoped_lock lock(_receive_mutex);
+            _reorder_cv.notify_all();
+        }
+        for (auto & queue : _queues) {
+            {
+                std::scoped_lock lock(queue->write_mutex);
+            }
+            queue->write_cv.notify_all();
+        }
+        for (auto & queue : _queues) {
+            queue->reader.join();
+            if (queue->writer.joinable()) {
+                queue->writer.join();
+            }
+        }
+        _reorder_thread.join();
+        if (_cache_flush_thread.joinable()) {
+           _cache_flush_thread.join();
+        }
+        stats_thread_.join();
+    }
+
+    const std::vector<Lane> & lanes() const {
+        return _lanes;
+    }
+
+    /**
+     * Take a send token of lane for a low priority request, if nothing was
+     * sent on it for a while, or if urgent whenever a token is available
+     */
+    bool reserveLane(size_t lane, bool urgent) {
+        auto now = SendGovernor::clock::now();
+        auto id = (std::int64_t) lane;
+        if (urgent ? _governor.sendTime(id, now) > now : !_governor.idle(id, now)) {
+            return false;
+        }
+        _governor.onSend(id, now);
+        return true;
+    }
+
+    /**
+     * Payload capacity of one message in bytes
+     */
+    size_t messageCapacity() const {
+        return _message_capacity;
+    }
+
+    bool isHeader(std::string_view text) const {
+        TextCodec::Type codec;
+        Kind kind;
+        Compressor::Type compression;
+        bool sequenced;
+        return _parseHeader(text, codec, kind, compression, sequenced) != 0;
+    }
+
+private:
+    /**
+     * Whether message came to transport from the peer of one of its lanes
+     */
+    bool _fromPeer(const Transport & transport, const ReceivedMessage & message) const {
+        for (const auto & lane : _lanes) {
+            if (&lane.transport == &transport
+                    && message.chat_id == lane.receive_from_user_id
+                    && message.sender_id == lane.receive_from_user_id) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void _onMessage(const Transport & transport, const ReceivedMessage & message) {
+        if (!_fromPeer(transport, message)) {
+            return;
+        }
+        std::scoped_lock lock(_receive_mutex);
+
+        std::string_view text = message.text;
+        if (text.empty()) {
+            return;
+        }
+
+        TextCodec::Type codec;
+        Kind kind;
+        Compressor::Type compression;
+        bool sequenced;
+        auto header_size = _parseHeader(text, codec, kind, compression, sequenced);
+        if (!header_size) {
+            return;
+        }
+
+        std::string_view data = message.document;
+        if (kind == DOCUMENT) {
+            count(IN_DOCUMENTS);
+        } else {
+            // Strip header from text and decode from base91x or base32768
+            auto begin = std::chrono::steady_clock::now();
+            TextCodec::decode(codec, text.substr(header_size), _receive_data);
+            _stats.record(IN_DECODE, std::chrono::steady_clock::now() - begin);
+            data = _receive_data;
+        }
+
+        if (!sequenced) {
+            _receivePayload(kind, compression, data);
+            return;
+        }
+        if (data.size() < SEQUENCE_SIZE) {
+            println(stderr, "Message of {} bytes is too short for a sequence number", data.size());
+            count(IN_MALFORMED);
+            return;
+        }
+        auto sequence = HeaderCompression::get32(reinterpret_cast<const uint8_t *>(data.data()));
+        data.remove_prefix(SEQUENCE_SIZE);
+
+        auto on_stored = [this](ReceivedPayload & payload) {
+            _receiveStored(payload);
+        };
+        auto action = _reorder.accept(sequence, on_stored);
+        if (_reorder.resynced) {
+            // The peer started over, so did sequence numbers of its header compression contexts
+            _header_decompressor.forget();
+        }
+        switch (action) {
+            case ReorderBuffer<ReceivedPayload>::DELIVER:
+                _receivePayload(kind, compression, data);
+                _reorder.release(on_stored);
+                break;
+            case ReorderBuffer<ReceivedPayload>::STORE:
+            {
+                auto & payload = _reorder.store(sequence, ReorderBuffer<ReceivedPayload>::clock::now());
+                payload.kind = kind;
+                payload.compression = compression;
+                payload.data.assign(data);
+                _reorder_cv.notify_one();
+                break;
+            }
+            case ReorderBuffer<ReceivedPayload>::DROP:
+                count(IN_DUPLICATE);
+                break;
+        }
+        _countReorder();
+    }
+
+    void _receiveStored(ReceivedPayload & payload) {
+        count(IN_REORDERED);
+        _receivePayload(payload.kind, payload.compression, payload.data);
+    }
+
+    void _countReorder() {
+        count(IN_REORDER_SKIPPED, std::exchange(_reorder.skipped, 0));
+        count(IN_LATE, std::exchange(_reorder.late, 0));
+        count(IN_RESYNC, std::exchange(_reorder.resynced, 0));
+        count(IN_HEADERS_STALE, std::exchange(_header_decompressor.stale, 0));
+    }
+
+    void _onPacketWritten() {
+        if (_first_packet.load(std::memory_order_relaxed)) {
+            return;
+        }
+        auto elapsed = std::chrono::steady_clock::now() - _created;
+        // Writers of several queues may get here at once
+        std::chrono::steady_clock::rep none = 0;
+        if (!_first_packet.compare_exchange_strong(none, elapsed.count())) {
+            return;
+        }
+        println("First packet received {:.3f} s after start", std::chrono::duration<double>(elapsed).count());
+    }
+
+    /**
+     * Write responses to DNS queries the cache can answer to the queue they were
+     * read from and remove the queries from its read batch
+     */
+    void _answerDns(Queue & queue) {
+        auto & packets = queue.read_batch;
+        auto & response = queue.dns_response;
+        size_t kept = 0;
+        for (size_t i = 0; i < packets.size(); i++) {
+            auto & packet = packets[i].data;
+            auto result = _dns->answer(packet.data(), packet.size(), response, packets[i].time);
+            if (result != DnsCache::MISS) {
+                if (queue.device.write(response.data(), response.size()) != (int) response.size()) {
+                    count(IN_WRITE_ERROR);
+                }
+            }
+            if (result == DnsCache::HIT) {
+                count(OUT_DNS_HIT);
+                continue;
+            }
+            count(result == DnsCache::MISS ? OUT_DNS_MISS : OUT_DNS_PREFETCH);
+            if (kept != i) {
+                packets[kept] = std::move(packets[i]);
+            }
+            kept++;
+        }
+        packets.resize(kept);
+    }
+
+    /**
+     * Let the DNS cache learn from a packet about to be written to TUN
+     * @return true if the packet is a response to a prefetch and must not be written
+     */
+    bool _learnDns(std::string_view packet) {
+        if (!_dns || !_dns->learn(packet, DnsCache::clock::now())) {
+            return false;
+        }
+        count(IN_DNS_PREFETCHED);
+        return true;
+    }
+
+    /**
+     * Write packets of a decoded message to TUN, receiving side only
+     */
+    void _receivePayload(Kind kind, Compressor::Type compression, std::string_view data) {
+        if (kind == SINGLE) {
+            if (_learnDns(data)) {
+                return;
+            }
+            _writePackets(&data, 1);
+            return;
+        }
+
+        std::string_view payload = data;
+        if (compression != Compressor::NONE) {
+            auto begin = std::chrono::steady_clock::now();
+            auto max_size = kind == DOCUMENT ? DOCUMENT_CAPACITY : _receiveMaxSize();
+            if (!_compressor.decompress(compression, data, _decompressed, max_size)) {
+                println(stderr, "Failed to decompress cache message of {} bytes", data.size());
+                count(IN_DECOMPRESS_ERROR);
+                return;
+            }
+            _stats.record(IN_DECOMPRESS, std::chrono::steady_clock::now() - begin);
+            payload = _decompressed;
+        }
+
+        // Slice packets from payload without copying, reassembling fragmented ones
+        _write_batch.clear();
+        _header_decompressor.reset();
+        bool ok = _unpacker.unpack(payload, [this](std::string_view packet) {
+            if (!_learnDns(packet)) {
+                _write_batch.push_back(packet);
+            }
+        }, [this](std::string_view frame) {
+            auto packet = _header_decompressor.decompress(frame);
+            if (packet.empty()) {
+                count(IN_HEADERS_LOST);
+            } else if (!_learnDns(packet)) {
+                _write_batch.push_back(packet);
+            }
+        });
+        auto i = _write_batch.size();
+        _writePackets(_write_batch.data(), _write_batch.size());
+        if (!ok) {
+            println(stderr,
+                "Malformed cache message after packet #{}\n"
+                "  packets: {}",
+                i,
+                stringToHex(payload)
+            );
+            count(IN_MALFORMED);
+        }
+    }
+
+    /**
+     * Write received packets to TUN, receiving side only. With several queues
+     * they are copied and handed to the writer of the queue of their flow, so
+     * packets of one flow keep their order
+     */
+    void _writePackets(const std::string_view * packets, size_t n) {
+        if (_queues.size() == 1) {
+            _writeToDevice(_queues.front()->device, packets, n);
+            return;
+        }
+        for (size_t i = 0; i < n; i++) {
+            bool control;
+            auto & queue = *_queues[FlowQueue<CachedPacket>::flowHash(packets[i], control) % _queues.size()];
+            if (packets[i].size() > _pool.bufferSize()) {
+                // Larger than any packet read from TUN, rare enough to write here
+                _writeToDevice(queue.device, &packets[i], 1);
+                continue;
+            }
+            auto buffer = _pool.acquire();
+            std::memcpy(buffer.data(), packets[i].data(), packets[i].size());
+            buffer.resize(packets[i].size());
+            queue.pending.push_back(std::move(buffer));
+        }
+        for (auto & queue : _queues) {
+            if (queue->pending.empty()) {
+                continue;
+            }
+            {
+                std::scoped_lock lock(queue->write_mutex);
+                auto room = TUN_WRITE_QUEUE_MAX - std::min(TUN_WRITE_QUEUE_MAX, queue->writes.size());
+                if (queue->pending.size() > room) {
+                    count(IN_WRITE_DROPPED, queue->pending.size() - room);
+                    queue->pending.resize(room);
+                }
+                std::move(queue->pending.begin(), queue->pending.end(), std::back_inserter(queue->writes));
+            }
+            queue->pending.clear();
+            queue->write_cv.notify_one();
+        }
+    }
+
+    size_t _writeToDevice(PacketDevice & device, const std::string_view * packets, size_t n) {
+        auto begin = std::chrono::steady_clock::now();
+        auto written = device.writeBatch(packets, n);
+        _stats.record(IN_TUN_WRITE, std::chrono::steady_clock::now() - begin);
+        if (written != n) {
+            println(stderr, "Failed to write packets to TUN, wrote {} packets instead of {}", written, n);
+            count(IN_WRITE_ERROR, n - written);
+        }
+        count(IN_WRITE_OK, written);
+        if (written) {
+            _onPacketWritten();
+        }
+        return written;
+    }
+
+    const std::string & _singleHeader() const {
+        return _single_header;
+    }
+
+    const std::string & _multipleHeader() const {
+        return _multiple_header;
+    }
+
+    std::string _makeHeader(TextCodec::Type codec, Kind kind, Compressor::Type compression) const {
+        bool unicode = codec == TextCodec::BASE32768;
+        auto header = kind == SINGLE ? (unicode ? MESSAGE_HEADER_UNICODE_SINGLE : MESSAGE_HEADER_TEXT_SINGLE)
+            : kind == MULTIPLE ? (unicode ? MESSAGE_HEADER_UNICODE_MULTIPLE : MESSAGE_HEADER_TEXT_MULTIPLE)
+            : (unicode ? MESSAGE_HEADER_UNICODE_DOCUMENT : MESSAGE_HEADER_TEXT_DOCUMENT);
+        if (auto tag = _compressionTag(compression)) {
+            header.insert(header.size() - 1, 1, tag);
+        }
+        header.insert(header.size() - 1, 1, SEQUENCE_TAG);
+        return header;
+    }
+
+    static char _compressionTag(Compressor::Type compression) {
+        switch (compression) {
+            case Compressor::LZ4:
+                return 'l';
+            case Compressor::ZSTD:
+                return 'z';
+            default:
+                return 0;
+        }
+    }
+
+    /**
+     * Bytes of cached packets at most, enough for a backlog worth documents if they are used
+     */
+    size_t _cacheLimit() const {
+        auto limit = CACHE_MAX_MESSAGES * _batch_capacity;
+        return _documents ? std::max(limit, 2 * _config.document_min_bytes) : limit;
+    }
+
+    /**
+     * Largest payload a peer may pack into one message, with any codec and compression
+     */
+    size_t _receiveMaxSize() const {
+        auto capacity = std::max(TextCodec::maxDataSize(TextCodec::BASE91X, MESSAGE_MAX_SIZE),
+            TextCodec::maxDataSize(TextCodec::BASE32768, MESSAGE_MAX_SIZE));
+        return (size_t) ((double) capacity * COMPRESSION_RATIO_MAX);
+    }
+
+    /**
+     * Block until a queue of TUN has a packet or stop() is called
+     * @return true if TUN is readable
+     */
+    bool _waitTun(const PacketDevice & device) {
+        pollfd fds[2] = {{device.nativeHandle(), POLLIN, 0}, {_wakeup_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) {
+                println(stderr, "Failed to poll TUN device: {}", std::strerror(errno));
+                _waitWakeup(100);
+            }
+            return false;
+        }
+        if (fds[0].revents & (POLLERR | POLLNVAL)) {
+            println(stderr, "TUN device poll error: {}", fds[0].revents);
+            count(OUT_TUN_READ_ERROR);
+            _waitWakeup(100);
+            return false;
+        }
+        return fds[0].revents & POLLIN;
+    }
+
+    /**
+     * Sleep for timeout_ms or until stop() is called
+     */
+    void _waitWakeup(int timeout_ms) {
+        pollfd fd{_wakeup_fd, POLLIN, 0};
+        poll(&fd, 1, timeout_ms);
+    }
+
+    static FlushScheduler::clock::duration _flushLatency(const Config & config) {
+        float ms = config.flush_latency_ms > 0 ? config.flush_latency_ms
+            : config.cache_flush_rate > 0 ? 1000.f / config.cache_flush_rate : 0.f;
+        return std::chrono::duration_cast<FlushScheduler::clock::duration>(std::chrono::duration<float, std::milli>(ms));
+    }
+
+    /**
+     * Add packet to _packer, with compressed headers when enabled
+     */
+    template <typename OnPayload>
+    void _pack(std::string_view packet, OnPayload && on_payload) {
+        if (_config.header_compression) {
+            // Uncompressed packets count too, as they take their room
+            _header_ratio += (1. - _header_ratio) / 64;
+            if (_packer.wouldFlush(packet.size())) {
+                // Compressed packet may still fit, else it starts the next message like an uncompressed one
+                if (_compressPacket(packet)) {
+                    return;
+                }
+                _packer.flush(on_payload);
+            }
+            if (_compressPacket(packet)) {
+                return;
+            }
+        }
+        _packer.add(packet, on_payload);
+    }
+
+    bool _compressPacket(std::string_view packet) {
+        auto room = _packer.room();
+        if (room <= Frame::HEADER_SIZE
+                || !_header_compressor.compress(packet, _compressed_packet, room - Frame::HEADER_SIZE)) {
+            return false;
+        }
+        _packer.addCompressed(_compressed_packet);
+        auto ratio = (double) MessagePacker::frameSize(packet.size()) / (double) MessagePacker::frameSize(_compressed_packet.size());
+        _header_ratio += (ratio - 1.) / 64;
+        count((uint8_t) _compressed_packet[0] & HeaderCompression::FULL ? OUT_HEADERS_FULL : OUT_HEADERS_COMPRESSED);
+        return true;
+    }
+
+    /**
+     * Send payload compressed if that pays off, payloads packed beyond the
+     * message capacity are split into several messages when they do not
+     * compress enough, unless they are too large for text and go as a document
+     */
+    void _sendPayload(std::string_view payload) {
+        if (_documents && (double) payload.size() > (double) _message_capacity * COMPRESSION_RATIO_MAX) {
+            _sendDocument(payload);
+            return;
+        }
+        if (_compressor.type() != Compressor::NONE) {
+            auto begin = std::chrono::steady_clock::now();
+            bool compressed = false;
+            if (Compressor::incompressible(payload)) {
+                count(OUT_COMPRESS_SKIPPED);
+            } else {
+                compressed = _compressor.compress(payload, _compressed);
+                _stats.record(OUT_COMPRESS, std::chrono::steady_clock::now() - begin);
+            }
+            if (compressed && _compressed.size() <= _message_capacity) {
+                _sendText(_multipleHeader(), _compressed);
+                _onPayloadSent(payload.size(), _compressed.size());
+                count(OUT_COMPRESSED);
+                count(OUT_COMPRESSED_BYTES, _compressed.size());
+                return;
+            }
+        }
+        auto split = Frame::prefix(payload, _message_capacity);
+        if (payload.size() > _message_capacity && split) {
+            _sendPayload(payload.substr(0, split));
+            _sendPayload(payload.substr(split));
+            return;
+        }
+        _sendText(_uncompressedHeader(), payload);
+        _onPayloadSent(payload.size(), payload.size());
+    }
+
+    void _onPayloadSent(size_t payload_size, size_t sent_size) {
+        count(OUT_MESSAGES);
+        count(OUT_PAYLOAD_BYTES, payload_size);
+        // Leave a margin below the recent ratio, so most batches fit into one message
+        auto ratio = 0.9 * (double) payload_size / (double) sent_size;
+        _compression_ratio = std::clamp(0.875 * _compression_ratio + 0.125 * ratio, 1., COMPRESSION_RATIO_MAX);
+    }
+
+    const std::string & _uncompressedHeader() const {
+        return _uncompressed_header;
+    }
+
+    /**
+     * Send payload as a document, compressed if that pays off
+     */
+    void _sendDocument(std::string_view payload) {
+        const std::string * header = &_uncompressed_document_header;
+        std::string_view data = payload;
+        if (_compressor.type() != Compressor::NONE) {
+            if (Compressor::incompressible(payload)) {
+                count(OUT_COMPRESS_SKIPPED);
+            } else {
+                auto begin = std::chrono::steady_clock::now();
+                if (_compressor.compress(payload, _compressed)) {
+                    header = &_document_header;
+                    data = _compressed;
+                }
+                _stats.record(OUT_COMPRESS, std::chrono::steady_clock::now() - begin);
+            }
+        }
+        _sequence(data);
+        count(OUT_MESSAGES);
+        count(OUT_PAYLOAD_BYTES, payload.size());
+        count(OUT_DOCUMENTS);
+        count(OUT_DOCUMENT_BYTES, _sequenced.size());
+
+        auto deadline = _retransmitDeadline();
+        _packed_deadline = _packet_deadline;
+        _send(*header, _sequenced, deadline);
+    }
+
+    /**
+     * Put the next sequence number and data into _sequenced
+     */
+    void _sequence(std::string_view data) {
+        _sequenced.resize(SEQUENCE_SIZE);
+        HeaderCompression::set32(reinterpret_cast<uint8_t *>(_sequenced.data()), _send_sequence++);
+        _sequenced.append(data);
+    }
+
+    /**
+     * Encode the next sequence number and data after header into _send_text and send it
+     */
+    void _sendText(const std::string & header, std::string_view data) {
+        auto begin = std::chrono::steady_clock::now();
+        _sequence(data);
+        _send_text.resize(header.size() + TextCodec::encodedSize(_codec, _sequenced.size()));
+        std::memcpy(_send_text.data(), header.data(), header.size());
+        _send_text.resize(header.size() + TextCodec::encode(_codec, _sequenced.data(), _sequenced.size(), _send_text.data() + header.size()));
+        _stats.record(OUT_ENCODE, std::chrono::steady_clock::now() - begin);
+        _stats.record(OUT_MESSAGE_SIZE, _send_text.size());
+        count(OUT_TEXT_BYTES, _send_text.size());
+
+        auto deadline = _retransmitDeadline();
+        // The packet being packed may continue in the next message
+        _packed_deadline = _packet_deadline;
+        _send(_send_text, {}, deadline);
+    }
+
+    /**
+     * Deadline of the message about to be sent, min() if it is never sent again
+     */
+    SendGovernor::clock::time_point _retransmitDeadline() const {
+        return _config.retransmit_deadline_ms > 0 ? _packed_deadline : SendGovernor::clock::time_point::min();
+    }
+
+    /**
+     * Send text, or document captioned with text if it is not empty, on the lane that may send first
+     * @param deadline - time to send the message again until if it fails, min() to never
+     * @param attempts - sends of the message so far
+     */
+    void _send(const std::string & text, std::string_view document, SendGovernor::clock::time_point deadline, unsigned attempts = 0) {
+        auto now = SendGovernor::clock::now();
+        SendGovernor::clock::time_point send_time;
+        auto lane = _nextLane(now, send_time);
+        _next_lane = (lane + 1) % _lanes.size();
+        _governor.onSend((std::int64_t) lane, now);
+
+        // 0 marks free slots
+        if (!++_send_id) {
+            ++_send_id;
+        }
+        auto id = _send_id;
+        {
+            std::scoped_lock lock(_unacked_mutex);
+            auto & unacked = _unacked[id % UNACKED_MAX_MESSAGES];
+            unacked.id = id;
+            unacked.sent = now;
+            auto & retransmit = unacked.retransmit;
+            retransmit.deadline = deadline;
+            retransmit.attempts = attempts;
+            if (deadline != SendGovernor::clock::time_point::min()) {
+                retransmit.text.assign(text);
+                retransmit.document.assign(document);
+            } else {
+                retransmit.text.clear();
+                retransmit.document.clear();
+            }
+        }
+
+        // Small enough for std::function to store without allocating
+        auto handler = [this, id, lane = (uint32_t) lane](const SendResult & result) {
+            _onSendResult(id, lane, result);
+        };
+        auto & transport = _lanes[lane].transport;
+        if (document.empty()) {
+            transport.sendTextMessage(_lanes[lane].send_to_chat_id, text, std::move(handler));
+        } else {
+            transport.sendDocument(_lanes[lane].send_to_chat_id, text, std::string(document), std::move(handler));
+        }
+    }
+
+    void _resend(const Retransmit & retransmit) {
+        count(OUT_RETRANSMIT);
+        _send(retransmit.text, retransmit.document, retransmit.deadline, retransmit.attempts);
+    }
+
+    /**
+     * Queue a failed message to send again, unless the error is permanent or its packets are stale
+     */
+    void _onSendFailed(const SendResult & result, Retransmit retransmit, SendGovernor::clock::time_point now) {
+        if (retransmit.text.empty()) {
+            return;
+        }
+        bool transient = result.error_code == 429 || result.error_code >= 500 || result.error_code <= 0;
+        if (!transient || ++retransmit.attempts >= RETRANSMIT_MAX_ATTEMPTS) {
+            count(OUT_RETRANSMIT_DROPPED);
+            return;
+        }
+        if (retransmit.deadline <= now) {
+            count(OUT_RETRANSMIT_STALE);
+            return;
+        }
+        {
+            std::scoped_lock lock(cache_mutex);
+            if (_retransmits.full()) {
+                count(OUT_RETRANSMIT_DROPPED);
+            }
+            _retransmits.push_back(std::move(retransmit));
+        }
+        cache_cv.notify_one();
+    }
+
+    /**
+     * Take the oldest failed message that is not stale, with cache_mutex held
+     * @return false if there is none
+     */
+    bool _takeRetransmit(SendGovernor::clock::time_point now, Retransmit & retransmit) {
+        while (!_retransmits.empty()) {
+            retransmit = std::move(_retransmits.front());
+            _retransmits.pop_front();
+            if (retransmit.deadline > now) {
+                return true;
+            }
+            count(OUT_RETRANSMIT_STALE);
+        }
+        return false;
+    }
+
+    /**
+     * Deadline of packet read at time for sending it again, pure TCP ACKs go stale soon
+     */
+    void _setPacketDeadline(std::string_view packet, FlushScheduler::clock::time_point time) {
+        auto deadline = std::chrono::duration_cast<SendGovernor::clock::duration>(
+            std::chrono::duration<float, std::milli>(_config.retransmit_deadline_ms));
+        HeaderCompression::Headers headers;
+        if (HeaderCompression::parse(packet, headers) && headers.protocol == HeaderCompression::PROTOCOL_TCP
+                && headers.header_size == packet.size() && (headers.data[33] & 0x07) == 0) {
+            deadline = std::min<SendGovernor::clock::duration>(deadline, RETRANSMIT_ACK_DEADLINE);
+        }
+        _packet_deadline = time + deadline;
+        _packed_deadline = std::max(_packed_deadline, _packet_deadline);
+    }
+
+    static std::vector<Lane> _makeLanes(const Config & config, const std::vector<Transport *> & transports) {
+        if (config.lanes.empty() || config.lanes.size() != transports.size()) {
+            throw std::runtime_error("Every lane needs a transport");
+        }
+        std::vector<Lane> lanes;
+        for (size_t i = 0; i < transports.size(); i++) {
+            lanes.push_back(Lane{*transports[i], config.lanes[i].send_to_chat_id, config.lanes[i].receive_from_user_id});
+        }
+        return lanes;
+    }
+
+    /**
+     * SendGovernor keys of lanes are their indexes, as accounts sharing a
+     * chat have separate rate limits
+     */
+    std::vector<std::int64_t> _laneIds() const {
+        std::vector<std::int64_t> ids(_lanes.size());
+        for (size_t i = 0; i < ids.size(); i++) {
+            ids[i] = (std::int64_t) i;
+        }
+        return ids;
+    }
+
+    /**
+     * Lane that may send first, ties go round-robin from _next_lane
+     */
+    size_t _nextLane(SendGovernor::clock::time_point now, SendGovernor::clock::time_point & send_time) {
+        size_t next = _next_lane;
+        send_time = SendGovernor::clock::time_point::max();
+        for (size_t i = 0; i < _lanes.size(); i++) {
+            auto lane = (_next_lane + i) % _lanes.size();
+            auto time = _governor.sendTime((std::int64_t) lane, now);
+            if (time < send_time) {
+                send_time = time;
+                next = lane;
+            }
+            if (time <= now) {
+                break;
+            }
+        }
+        return next;
+    }
+
+    /**
+     * Header is "#iot", codec "t" or "u", "s" for a single packet, "m" for
+     * a batch or "d" for a document, compression "l" or "z" of a compressed
+     * batch, "n" if data starts with a sequence number, and a space, which
+     * a document caption may lack
+     * @return header size, or 0 if text is not a tunnel message
+     */
+    size_t _parseHeader(std::string_view text, TextCodec::Type & codec, Kind & kind, Compressor::Type & compression, bool & sequenced) const {
+        const std::string_view prefix = "#iot";
+        if (text.size() < prefix.size() + 3 || text.substr(0, prefix.size()) != prefix) {
+            return 0;
+        }
+        switch (text[prefix.size()]) {
+            case 't': codec = TextCodec::BASE91X; break;
+            case 'u': codec = TextCodec::BASE32768; break;
+            default: return 0;
+        }
+        switch (text[prefix.size() + 1]) {
+            case 's': kind = SINGLE; break;
+            case 'm': kind = MULTIPLE; break;
+            case 'd': kind = DOCUMENT; break;
+            default: return 0;
+        }
+        size_t size = prefix.size() + 2;
+        compression = Compressor::NONE;
+        if (kind != SINGLE) {
+            for (auto type : {Compressor::LZ4, Compressor::ZSTD}) {
+                if (text[size] == _compressionTag(type)) {
+                    compression = type;
+                    size++;
+                    break;
+                }
+            }
+        }
+        sequenced = size < text.size() && text[size] == SEQUENCE_TAG;
+        if (sequenced) {
+            size++;
+        }
+        if (size == text.size() && kind == DOCUMENT) {
+            // Telegram trims trailing spaces of captions
+            return size;
+        }
+        if (size >= text.size() || text[size] != ' ') {
+            return 0;
+        }
+        return size + 1;
+    }
+};
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <fmt/format.h>
+
+#define print(...) do { fmt::print(__VA_ARGS__); std::fflush(stdout); } while (0)
+#define println(...) do { fmt::println(__VA_ARGS__); std::fflush(stdout); } while (0)
+
+
+inline std::string stringToHex(std::string_view input) {
+    std::ostringstream oss;
+    for (char c : input) {
+        oss << fmt::format("{:02x} ", static_cast<unsigned char>(c));
+    }
+    std::string result = oss.str();
+    if (!result.empty()) {
+        result.pop_back();  // Remove trailing space
+    }
+    return result;
+}